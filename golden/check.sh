@@ -0,0 +1,123 @@
+#!/bin/bash
+#---------------------------------------------------------------------------
+# Golden image regression check for imgResample
+#
+# Resamples the bundled images at a matrix of scales and filters and checks
+# each result against the golden output stored next to this script with
+# --compare.  The small fixtures in input/ cover every format the reader
+# takes: plain P1, P2 and P3, raw P4 and P5, 16 bit samples and PAM with
+# alpha.  Every image is scaled down and the small ones are scaled up as
+# well, which keeps the goldens small.  The default tiled float
+# engine must match the goldens exactly with any tile size or thread
+# count.  The double engine and --tile off round differently and are
+# checked against the same goldens with a PSNR of at least $PSNR dB,
+# default 60, they are within one sample step.
+#
+#   golden/check.sh              build and check, exits 1 on any failure
+#   golden/check.sh regen        rewrite the goldens after an intended change
+#   golden/check.sh bench FILE   check, then time the larger images and a
+#                                large generated plain P3, resampling and
+#                                reading, and fail if either is slower than
+#                                the throughput recorded in FILE by more
+#                                than $TOLERANCE percent, default 25.  The
+#                                first run records it, FILE belongs to the
+#                                machine it ran on, which should be idle
+#
+# CC and CFLAGS pick the compiler and flags of the build that is checked.
+#---------------------------------------------------------------------------
+GOLDEN=$(cd "$(dirname "$0")" && pwd)
+REPO=$(dirname "$GOLDEN")
+WORK=$(mktemp -d)
+BIN=$WORK/imgResample
+trap 'rm -rf "$WORK"' EXIT
+
+FIXTURES=$(cd "$REPO" && echo golden/input/*)
+IMAGES="gogol-182x150.ppm Matisse-227x237.ppm img.pbm rbgTest-16x16.pbm test-4x4.pbm $FIXTURES"
+SMALL="rbgTest-16x16.pbm test-4x4.pbm $FIXTURES"
+FILTERS="cubic linear corner sharpen"
+EXACT=("" "--tile 32x32" "--threads 4 --tile 64x16")
+CLOSE=("--engine double" "--tile off")
+
+${CC:-cc} ${CFLAGS:--O2} "$REPO/imgResample.c" -o "$BIN" -lm -pthread || exit 1
+
+# scales image - the factors an image is checked at
+scales() {
+   case " $SMALL " in
+      *" $1 "*) echo "0.5 0.37 1.7 3 2x 2up 4up" ;;
+      *)        echo "0.5 0.37 2x" ;;
+   esac
+}
+
+filter_options() {
+   case $1 in
+      linear)  echo "--linear" ;;
+      corner)  echo "--align corner" ;;
+      sharpen) echo "--sharpen 0.5" ;;
+   esac
+}
+
+# check golden options... - resample with each set of options and compare
+checks=0
+failures=0
+check() {
+   local golden=$1 options=$2 psnr=$3 result
+
+   shift 3
+   $BIN $options "$@" "$WORK/out.pnm" > /dev/null 2>&1 || { echo "FAIL $options $*: resample failed"; failures=$((failures + 1)); return; }
+   result=$($BIN ${psnr:+--psnr $psnr} --compare "$golden" "$WORK/out.pnm")
+   [ $? -eq 0 ] || { echo "${result/$WORK\/out.pnm/$options $*}"; failures=$((failures + 1)); }
+   checks=$((checks + 1))
+}
+
+for image in $IMAGES; do
+   name=$(basename "${image%.*}")
+   for scale in $(scales $image); do
+      for filter in $FILTERS; do
+         # The quick kernels have no filter options
+         case $scale in 2x|2up|4up) [ $filter = cubic ] || continue ;; esac
+         golden=$GOLDEN/$name.$filter.$scale.pnm
+         options=$(filter_options $filter)
+
+         if [ "$1" = regen ]; then
+            $BIN $options $scale "$REPO/$image" "$golden" > /dev/null || exit 1
+            continue
+         fi
+         for variant in "${EXACT[@]}"; do
+            check "$golden" "$variant $options" "" $scale "$REPO/$image"
+         done
+         # Only the tiled float engine sharpens, the quick kernels have one engine
+         case $scale-$filter in 2x-*|2up-*|4up-*|*-sharpen) continue ;; esac
+         for variant in "${CLOSE[@]}"; do
+            check "$golden" "$variant $options" "${PSNR:-60}" $scale "$REPO/$image"
+         done
+      done
+   done
+done
+[ "$1" = regen ] && { echo "Goldens written to $GOLDEN"; exit 0; }
+
+if [ "$1" = bench ] && [ -n "$2" ]; then
+   # The small images take microseconds, too little to time.  Images are
+   # named from the top of the tree so FILE works from any checkout
+   baseline=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+   bench() {
+      result=$($BIN --bench 9 --baseline "$baseline" --tolerance ${TOLERANCE:-25} "$@" "$WORK/out.pnm")
+      [ $? -eq 0 ] || { echo "$result" | grep REGRESSION; failures=$((failures + 1)); }
+      checks=$((checks + 1))
+   }
+   cd "$REPO" || exit 1
+   for image in $IMAGES; do
+      case " $SMALL " in *" $image "*) continue ;; esac
+      for scale in $(scales $image); do
+         bench $scale "$image"
+      done
+   done
+
+   # The plain parser reads a digit at a time, a large P3 times it
+   cd "$WORK" || exit 1
+   $BIN --generate noise 2000x1500 3 noise.ppm > /dev/null || exit 1
+   $BIN --ascii 1 noise.ppm noise-p3.ppm > /dev/null || exit 1
+   bench 0.5 noise-p3.ppm
+fi
+
+echo "$checks checks, $failures failed"
+[ $failures -eq 0 ]
@@ -1,19 +1,58 @@
 /*---------------------------------------------------------------------------
   This program reads sample PPM images and resamples them up or down by a factor
-  or uses a quick 2X down sample
+  or uses a quick 2X down sample.  Gray PGM (P5) images are resampled as a
+  single channel and PBM (P4) bitmaps are unpacked to gray on load.  Any
+  maxval from 1 to 65535 is kept end to end, 16 bit samples use wide kernels.
+  Plain (ASCII) P1/P2/P3 files are read too and --ascii writes P2/P3.  PAM
+  (P7) images with alpha are resampled with premultiplied color.  --serve
+  keeps the workers, buffers and plans warm behind a Unix domain socket for
+  --client and --loadgen requests, images can be passed as sealed memfds.
+  Clients can read and write any file the server user can through in= and
+  out=, so the socket is created 0600 for that user only.
+  --cache keeps outputs on disk so repeated requests skip the resample.
+  --stats writes per stage timings and hardware counters as JSON.
+  --compare checks outputs against golden images and --bench checks the
+  resample and read throughput against a recorded baseline, --generate
+  writes large synthetic images to benchmark with.  Factors 2up and 4up
+  are quick exact up samples.
+  --sharpen applies an unsharp mask to each tile as it is resampled and
+  --output converts to gray or YCbCr 4:2:0 planes as the tiles are stored.
+  --rotate and --affine warp the image with the same cubic.  --update
+  redoes only the output pixels that read changed rectangles of the source.
+  --memory-limit resamples images larger than memory in strips of rows.
   
-  gcc -g imgResample.c -o imgResample -lm 
-  gcc -g imgResample.c -o imgResample -lm -fsanitize=address -fsanitize=undefined
+  gcc -g imgResample.c -o imgResample -lm -pthread
+  gcc -g imgResample.c -o imgResample -lm -pthread -fsanitize=address -fsanitize=undefined
+  gcc -g -DTRACE imgResample.c -o imgResample -lm -pthread    (prints every sample)
+  gcc -O3 -march=native imgResample.c -o imgResample -lm -pthread    (vectorizes the quick kernels)
   
  resample code:
   https://stackoverflow.com/questions/34622717/bicubic-interpolation-in-c
   https://pastebin.com/sQDQg7SG
 ----------------------------------------------------------------------------*/
+#define _GNU_SOURCE              // memfd_create and MSG_CMSG_CLOEXEC
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
 
 typedef struct {
    unsigned char red,green,blue;
@@ -21,324 +60,5860 @@ typedef struct {
 
 typedef struct {
    int x, y;
-   PPMPixel *data;
+   int channels;        // Samples per pixel, 1 gray, 2 gray+alpha, 3 RGB, 4 RGB+alpha
+   int maxval;          // Largest sample value, above 255 samples are 16 bit
+   unsigned char *data; // Samples, 16 bit samples are stored in host byte order
+   size_t stride;       // Bytes from one row to the next, 0 for packed rows.  Loaded
+                        // images are always packed
+   int top;             // Row held at the start of data, 0 unless the image is a
+                        // strip of rows of a larger one that doesn't fit in memory
 } PPMImage;
 
+typedef struct {
+   char format;         // Magic number digit, eg '6' for P6
+   int x, y;            // Image size
+   int channels;        // Samples per pixel stored in memory
+   int maxval;          // Largest sample value
+   off_t offset;        // Byte offset of the pixel data in the file
+} PPMHeader;
+
+typedef struct {
+   int fd;                    // Open file, used when mem is NULL
+   const unsigned char *mem;  // Image bytes already in memory
+   uint64_t size;             // Bytes in the file or buffer
+} PPMSource;
+
+typedef struct {
+   void *ptr;
+   size_t size;
+} PoolEntry;
+
+typedef struct {
+   char name[21];       // Entry file name, 16 hex digits and .ppm
+   uint64_t size;
+   double used;         // Time of the last use
+} CacheEntry;
+
+typedef struct {
+   int maxval;          // Largest sample value the tables are built for
+   float *to_linear;    // maxval+1 entries, sample to linear light in maxval units
+   uint8_t *to_srgb;    // LINEAR_LUT_SIZE entries from linear light back to a sample,
+                        // NULL for 16 bit images which use the formula
+} LinearTables;
+
+typedef struct {
+   int x0, y0;          // Top left pixel
+   int x1, y1;          // One past the bottom right pixel
+} ImageRect;
+
+typedef struct {
+   int linear;          // Interpolate in linear light instead of on sRGB values
+   int tile_x, tile_y;  // Tile size in destination pixels, 0 sizes tiles from the
+                        // cache size and -1 turns tiling off
+   int align;           // ALIGN_CENTER or ALIGN_CORNER source mapping
+   int engine;          // ENGINE_FLOAT or ENGINE_DOUBLE tile arithmetic
+   double amount;       // Unsharp mask strength, 0 turns sharpening off
+   double radius;       // Unsharp mask blur sigma in destination pixels
+   double threshold;    // Smallest difference from the blur that is sharpened, in sample steps
+   int output;          // OUTPUT_RGB, OUTPUT_GRAY, OUTPUT_YCBCR420 or OUTPUT_CHROMA
+   int warp;            // WARP_NONE, WARP_AFFINE or WARP_ROTATE
+   double affine[6];    // WARP_AFFINE destination to source matrix, see warp_matrix
+   double angle;        // WARP_ROTATE degrees counterclockwise about the centers
+   int fill;            // Color sample value where a warp leaves the source
+} ResampleOptions;
+
+typedef struct {
+   int src_x, src_y;    // Source size the plan was built for
+   int dst_x, dst_y;    // Destination size
+   int channels;        // Samples per pixel the scratch buffers are sized for
+   int *xint, *yint;    // Source pixel at or before each destination column and row
+   int *xphase, *yphase;   // Weight set of each destination column and row
+   double *xweight;     // Polyphase banks, CUBIC_TAPS weights for each phase
+   double *yweight;
+   float *xweight_f;    // The banks rounded for the float engine
+   float *yweight_f;
+   int phases_x, phases_y; // Weight sets in each bank
+   int tile_x, tile_y;  // Tile size in destination pixels
+   int tiles_x, tiles_y;   // Number of tiles across and down
+   int window_x, window_y; // Largest source window of any tile
+   int want_x, want_y;  // Tile size asked for, part of the plan cache key
+   int align;           // Mapping the positions were built for
+   double amount, radius, threshold;   // Unsharp mask the plan was built for
+   int halo;            // Destination pixels resampled around a tile for the blur
+   float *blur;         // 2*halo+1 Gaussian taps of the unsharp mask
+   int refs;            // Jobs using a cached plan, -1 if the plan is not cached
+   unsigned long used;  // Plan cache clock of the last use
+} ResamplePlan;
+
+typedef struct {
+   double *window;      // Decoded source window of a tile, floats for the float engine
+   double *rows;        // Horizontally filtered source rows of a tile, likewise
+   float *line;         // Vertical sums of one tile row for the float engine, with
+                        // room for the halo to pad rows for the sharpen blur
+   float *block;        // Resampled tile and halo when sharpening
+   float *blurred;      // Block blurred across, tile columns only
+   size_t window_size, rows_size, line_size, block_size, blurred_size;   // Bytes in each buffer
+} TileScratch;
+
+#define PERF_COUNTERS (4)     // Cycles, instructions, cache misses, branch misses
+
+typedef struct {
+   struct timespec start;
+   uint64_t counter[PERF_COUNTERS];   // Counts over all threads at the start
+} StageMark;
+
+typedef struct {
+   uint64_t calls;
+   double seconds;
+   uint64_t bytes;      // Bytes read or written
+   uint64_t pixels;     // Pixels produced
+   uint64_t counter[PERF_COUNTERS];   // Hardware counts over all threads
+} StageStats;
+
+typedef struct {
+   ResamplePlan *plan;
+   PPMImage *source_image, *destination_image;
+   LinearTables *lin;
+   int engine;             // ENGINE_FLOAT or ENGINE_DOUBLE
+   int output;             // OUTPUT_RGB, OUTPUT_GRAY or OUTPUT_CHROMA conversion of the stores
+   int warp;               // Set to warp by affine rather than resample
+   double affine[6];       // Destination pixel to source position matrix of a warp
+   int fill;               // Color sample value outside the warped source
+   ImageRect *rects;       // Destination rectangles to redo, one per tile at most, or
+                           // NULL to do every tile of the plan
+   int tiles;              // Tiles or rectangles to do
+   uint64_t pixels;        // Destination pixels they cover
+   TileScratch **scratch;  // One per worker, made by the worker on its first tile
+   int workers;            // Entries in scratch
+   int threaded;           // Set when the tiles were queued on the scheduler
+   atomic_int remaining;   // Tiles not finished yet
+   int finished;           // Set under lock when the last tile is done
+   pthread_mutex_t lock;
+   pthread_cond_t done;
+   StageMark mark;         // Start of the job for --stats
+} ResampleJob;
+
+typedef struct {
+   ResampleJob *job;
+   int begin, end;         // Tiles still to do
+} TileTask;
+
+typedef struct {
+   pthread_mutex_t lock;
+   TileTask *tasks;        // The owner uses the tail, thieves take from the head
+   int head, tail, size;
+} TaskDeque;
+
+struct Scheduler;
+
+typedef struct {
+   int id;
+   struct Scheduler *sched;
+   pthread_t thread;
+   TaskDeque deque;
+} Worker;
+
+typedef struct Scheduler {
+   Worker *worker;
+   int workers;
+   atomic_int queued;      // Tiles waiting in any deque
+   int stop;
+   pthread_mutex_t lock;   // Guards the sleep and stop state
+   pthread_cond_t wake;
+} Scheduler;
+
 PPMImage *resize2(PPMImage *source_image);
+void resize2_into(PPMImage *source_image, PPMImage *destination_image);
+PPMImage *resize_up(PPMImage *source_image, int factor);
+void resize_up_into(PPMImage *source_image, PPMImage *destination_image, int factor);
 
 #define CREATOR "FELIXKLEMM"
 #define RGB_COMPONENT_COLOR 255
-#define BUFFER_SIZE (256) 
+#define MAX_COMPONENT_COLOR 65535      // Largest maxval, 2 bytes per sample above 255
+#define PPM_HEADER_MAX (4096)          // Largest header accepted, comments included
+#define PPM_MAX_DIMENSION (1L << 24)   // Largest width or height accepted
+#define MAX_CHANNELS 4
+#define CUBIC_TAPS (4)                 // Source samples under the cubic at each position
+#define ALIGN_CENTER (0)               // Pixel areas of source and destination meet
+#define ALIGN_CORNER (1)               // First and last pixel centers meet
+#define ENGINE_FLOAT (0)               // Tiles are filtered in single precision
+#define ENGINE_DOUBLE (1)              // Tiles are filtered in double precision
+#define DEFAULT_SHARPEN_RADIUS (1.0)   // Unsharp mask sigma when --sharpen gives none
+#define MAX_SHARPEN_RADIUS (16.0)
+#define OUTPUT_RGB (0)                 // Destination keeps the source channels
+#define OUTPUT_GRAY (1)                // Destination is the luma of the resampled color
+#define OUTPUT_YCBCR420 (2)            // Luma plus half size Cb and Cr planes in a raw file
+#define OUTPUT_CHROMA (3)              // Cb and Cr samples, the half size planes of OUTPUT_YCBCR420
+#define WARP_NONE (0)                  // Axis aligned resample
+#define WARP_AFFINE (1)                // Warp by a matrix given in source and destination pixels
+#define WARP_ROTATE (2)                // Rotate about the image centers
+#define WARP_SNAP (65536.0)            // Warp source positions are rounded to 1/WARP_SNAP pixel
+#define WARP_RUN (32)                  // Warp positions are stepped at most this many pixels from
+                                       // one computed from the matrix
+#define BUFFER_SAMPLES (8192)          // Samples byte swapped per write
+#define ASCII_BUFFER_SIZE (65536)      // Bytes of plain raster text per write
+#define LINEAR_LUT_SIZE (4096)         // Entries in the linear to sRGB table
+#define MAX_TILE_SIZE (512)            // Largest automatic tile edge
+#define MIN_TILE_SIZE (16)             // Smallest automatic tile edge
+#define DEFAULT_CACHE_SIZE (256*1024)  // L2 size assumed when it can't be read
+#define BATCH_IN_FLIGHT (8)            // Batch images queued on the workers at once
+#define BATCH_LINE_SIZE (1024)
+#define FRAME_BLOCK (32)               // Square source blocks compared between batch frames
+#define MAX_THREADS (1024)
+#define BUFFER_POOL_ENTRIES (32)       // Freed buffers kept by a server
+#define BUFFER_POOL_BYTES (1UL << 30)  // Most bytes kept in the buffer pool
+#define PLAN_CACHE_SIZE (16)           // Resample plans kept by a server
+#define MAX_INLINE_BYTES (1UL << 31)   // Largest image sent over the socket
+#define LISTEN_BACKLOG (64)
+#define MAX_PASSED_FDS (8)             // Descriptors a connection holds before use
+#define CACHE_VERSION (2)              // Bump when resampled output changes so old entries miss
+#define CACHE_PATH_SIZE (4096)
+#define DEFAULT_CACHE_LIMIT (1UL << 30)   // Bytes kept in the output cache
+#define STAGE_READ (0)                 // Stages measured by --stats
+#define STAGE_RESAMPLE (1)
+#define STAGE_WRITE (2)
+#define STAGE_TOTAL (3)
+#define STAGE_COUNT (4)
+#define DEFAULT_BENCH_TOLERANCE (10)   // Percent slower than the baseline --bench allows
+#define GENERATE_GRADIENT (0)          // Patterns written by --generate
+#define GENERATE_NOISE (1)
+#define GENERATE_CHECKER (2)
+#define GENERATE_TEXT (3)
+#define GENERATE_SQUARE (32)           // Checkerboard square size
+#define UP_WEIGHT_BITS (10)            // Fraction bits of the quick up sample weights
+#define UP_RING_ROWS (8)               // Filtered source rows kept by the quick up sample
+
+typedef struct {
+   int listen_fd;
+   const ResampleOptions *defaults;   // Options from the server command line
+   int stopping;           // Set by a shutdown request
+   int busy;               // Requests being served
+   pthread_mutex_t lock;
+   pthread_cond_t idle;
+} Server;
+
+typedef struct {
+   Server *server;
+   int fd;
+   unsigned char buf[BATCH_LINE_SIZE];    // Bytes read ahead of the request served
+   size_t start, end;
+   int fds[MAX_PASSED_FDS];   // Descriptors passed by the client, used in order
+   int nfds;
+} ServerConnection;
+
+typedef struct {
+   char *line;             // Request line without the newline
+   unsigned char *payload; // Inline image sent after the line, or NULL
+   size_t payload_size;
+   int fds[2], nfds;       // Descriptors sent with the line, input first
+   const char *save;       // File to save an inline reply in, or NULL
+   PPMImage shared;        // Shared memory output, data is NULL if none
+   size_t shared_size;
+   const char *shared_save;   // File to save the shared output in
+} ClientRequest;
+
+typedef struct {
+   const char *socket_path;
+   const ClientRequest *req;  // Request sent over and over
+   atomic_int next;        // Next request number to send
+   int count;              // Requests to send
+   double *latency;        // Seconds per request
+   int failed;
+   pthread_mutex_t lock;
+} LoadGen;
 
 
 
 // Clamps the returned value between min and max, otherwise returns the value
 #define CLAMP(v, min, max) if(v < min) { v = min; } else if(v > max) { v = max; }
 
-int debug = 0;
+// Calls fn(args, channels, wide) with constant format arguments so every pixel
+// format gets a dedicated kernel, wide is set for 16 bit samples
+#define DISPATCH_FORMAT(img, fn, ...) do {                                  \
+   switch ((img)->channels * 2 + image_wide(img)) {                         \
+      case 2: fn(__VA_ARGS__, 1, 0); break;                                 \
+      case 3: fn(__VA_ARGS__, 1, 1); break;                                 \
+      case 4: fn(__VA_ARGS__, 2, 0); break;                                 \
+      case 5: fn(__VA_ARGS__, 2, 1); break;                                 \
+      case 6: fn(__VA_ARGS__, 3, 0); break;                                 \
+      case 7: fn(__VA_ARGS__, 3, 1); break;                                 \
+      case 8: fn(__VA_ARGS__, 4, 0); break;                                 \
+      default: fn(__VA_ARGS__, 4, 1); break;                                \
+   }                                                                        \
+} while (0)
+
+// Applies cubic_weights w to samples A..D.  The weights sum to one so the
+// weight of B is left out, flat areas then come out exactly equal to B
+#define CUBIC_SUM(w, A, B, C, D) ((B) + (w)[0]*((A) - (B)) + (w)[2]*((C) - (B)) + (w)[3]*((D) - (B)))
+
+// Gray+alpha and RGB+alpha images carry alpha as the last channel
+#define HAS_ALPHA(channels) ((channels) == 2 || (channels) == 4)
+
+// Tracing is compiled in with -DTRACE, other builds have no trace branches
+// in the kernels at all.  The arguments still count as used there, so a
+// parameter kept only for the trace doesn't warn
+#ifdef TRACE
+#define TRACE_PRINTF(...) printf(__VA_ARGS__)
+#define TRACE_SAMPLE(x, y, sample, channels) trace_sample(x, y, sample, channels)
+#define TRACE_ROW_F(plan, line, x0, x1, y, lin, maxval, channels) \
+   trace_row_f(plan, line, x0, x1, y, lin, maxval, channels)
+#else
+#define TRACE_PRINTF(...) do { } while (0)
+#define TRACE_SAMPLE(x, y, sample, channels) do { (void)(x); (void)(y); } while (0)
+#define TRACE_ROW_F(plan, line, x0, x1, y, lin, maxval, channels) do { } while (0)
+#endif
+
+int ascii_output = 0;      // Write plain P2/P3 files, set by --ascii
+Scheduler *scheduler = NULL;  // Worker pool, NULL runs tiles on the calling thread
+int quiet = 0;             // Skip the per image messages, set by the server
+
+// Freed pixel and scratch buffers kept for reuse when enabled
+struct {
+   int enabled;
+   pthread_mutex_t lock;
+   PoolEntry entry[BUFFER_POOL_ENTRIES];
+   int count;
+   size_t bytes;
+} buffer_pool = { 0, PTHREAD_MUTEX_INITIALIZER, { { NULL, 0 } }, 0, 0 };
+
+// Plans reused by jobs with the same sizes when enabled
+struct {
+   int enabled;
+   pthread_mutex_t lock;
+   ResamplePlan *plan[PLAN_CACHE_SIZE];
+   unsigned long clock;
+} plan_cache = { 0, PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+
+// On-disk output cache, off while dir is NULL
+struct {
+   const char *dir;
+   uint64_t limit;         // Bytes kept, least recently used entries go past it
+   uint64_t total;         // Bytes in entries as of the last scan and stores, guarded by lock
+   atomic_int hits, misses;
+   int evictions;          // Guarded by lock
+   atomic_uint serial;     // Numbers temporary file names
+   pthread_mutex_t lock;   // One eviction scan at a time
+} output_cache = { NULL, DEFAULT_CACHE_LIMIT, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Stage measurements for --stats, off unless enabled
+struct {
+   int enabled;
+   int counters;           // 1 once hardware counters are open, -1 if they can't be
+   pthread_mutex_t lock;
+   int *fd;                // PERF_COUNTERS counter descriptors per thread
+   int threads;
+   StageStats stage[STAGE_COUNT];
+} stats = { 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, { { 0, 0.0, 0, 0, { 0 } } } };
 
 /*---------------------------------------------------------------------------
-   This function reads a PPM image and returns the binary pixel data 
-   in a single 1D array.    
+   These functions describe the in memory sample layout of an image
    
-   const char *filename - File name to open
+      const PPMImage *img  - Image to describe
   
-   Returns: PPMImage *readPPM    Pointer to a mallloced data structure
+   Returns: image_wide        1 if samples are 16 bit, else 0
+            image_pixel_bytes Bytes per pixel
+            image_size        Bytes of pixel data
+            image_row         Pointer to the start of row y, which must be held
    
-   Error Handling:   exits with an error code
+   Error Handling:   none
 ----------------------------------------------------------------------------*/
-static PPMImage *readPPM(const char *filename) {
-   char buff[BUFFER_SIZE];
-   PPMImage *img;
-   FILE *fp;
+static inline int image_wide(const PPMImage *img) {
+   return(img->maxval > RGB_COMPONENT_COLOR);
+}
 
-   int c, rgb_comp_color;
+static inline size_t image_pixel_bytes(const PPMImage *img) {
+   return((size_t)img->channels << image_wide(img));
+}
 
-   //open PPM file for reading
-   fp = fopen(filename, "rb");
-   if(!fp) {
-      fprintf(stderr, "Unable to open file '%s'\n", filename);
-      exit(1);
+static inline size_t image_size(const PPMImage *img) {
+   return((size_t)img->x * (size_t)img->y * image_pixel_bytes(img));
+}
+
+static inline unsigned char *image_row(const PPMImage *img, int y) {
+   return(img->data + (size_t)(y - img->top) * (img->stride ? img->stride : (size_t)img->x * image_pixel_bytes(img)));
+}
+
+/*---------------------------------------------------------------------------
+   This function converts 16 bit samples between the big endian file order
+   and the host order.  It is a plain loop so the compiler vectorizes it, and
+   src may equal dst to swap in place.
+   
+      uint16_t *dst         - Converted samples
+      const uint16_t *src   - Samples to convert
+      size_t count          - Number of samples
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void swap_samples16(uint16_t *dst, const uint16_t *src, size_t count) {
+   size_t i;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   for (i = 0; i < count; i++) {
+      dst[i] = (uint16_t)((src[i] >> 8) | (src[i] << 8));
+   }
+#else
+   if (dst != src) {
+      for (i = 0; i < count; i++) { dst[i] = src[i]; }
    }
+#endif
+}
 
-   //read image format
-   if(!fgets(buff, sizeof(buff), fp)) {
-      perror(filename);
-      exit(1);
+/*---------------------------------------------------------------------------
+   This function checks binary samples against maxval.  The linear tables
+   have maxval + 1 entries and are indexed by sample, so a sample above it
+   would read past them.  Maxvals of 255 and 65535 can't be exceeded and
+   are not scanned, the others take one pass the compiler vectorizes.
+   
+      const unsigned char *data  - Samples, 16 bit ones in host order
+      size_t count               - Number of samples
+      int maxval                 - Largest sample allowed
+  
+   Returns: const char *  NULL on success, otherwise an error message
+   
+   Error Handling:   returns an error message
+----------------------------------------------------------------------------*/
+static const char *check_maxval(const unsigned char *data, size_t count, int maxval) {
+   const uint16_t *wide = (const uint16_t *)data;
+   unsigned int high = 0;
+   size_t i;
+
+   if (maxval == RGB_COMPONENT_COLOR || maxval == MAX_COMPONENT_COLOR) { return(NULL); }
+   if (maxval > RGB_COMPONENT_COLOR) {
+      for (i = 0; i < count; i++) { high = (wide[i] > high) ? wide[i] : high; }
    }
+   else {
+      for (i = 0; i < count; i++) { high = (data[i] > high) ? data[i] : high; }
+   }
+   return((high > (unsigned int)maxval) ? "Sample larger than maxval" : NULL);
+}
 
-   //check the image format
-   if(buff[0] != 'P' || buff[1] != '6') {
-      fprintf(stderr, "Invalid image format (must be 'P6')\n");
-      exit(1);
+/*---------------------------------------------------------------------------
+   This function skips whitespace and comments in a header buffer.  A '#'
+   starts a comment that runs to the end of the line, and comments may
+   appear anywhere whitespace is allowed.
+   
+      const unsigned char *buf   - Header bytes
+      size_t len                 - Number of valid bytes in buf
+      size_t pos                 - Offset to start scanning at
+  
+   Returns: size_t offset of the next token character (len if none)
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static size_t skip_header_space(const unsigned char *buf, size_t len, size_t pos) {
+   while (pos < len) {
+      if (buf[pos] == '#') {
+         while (pos < len && buf[pos] != '\n' && buf[pos] != '\r') { pos++; }
+      }
+      else if (buf[pos] == ' ' || buf[pos] == '\t' || buf[pos] == '\n' ||
+               buf[pos] == '\r' || buf[pos] == '\v' || buf[pos] == '\f') {
+         pos++;
+      }
+      else {
+         break;
+      }
    }
+   return(pos);
+}
 
-   //alloc memory form image
-   img = (PPMImage *)malloc(sizeof(PPMImage));
-   if(!img) {
-      fprintf(stderr, "Unable to allocate memory\n");
-      exit(1);
+/*---------------------------------------------------------------------------
+   This function reads one unsigned decimal header field.
+   
+      const unsigned char *buf   - Header bytes
+      size_t len                 - Number of valid bytes in buf
+      size_t *pos                - In: offset of the field, out: offset past it
+      long max                   - Largest value accepted
+      long *value                - Returned value
+  
+   Returns: int  0 on success, -1 if the field is missing, malformed or > max
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int read_header_number(const unsigned char *buf, size_t len, size_t *pos, 
+                              long max, long *value) {
+   size_t p = skip_header_space(buf, len, *pos);
+   long v = 0;
+
+   if (p >= len || buf[p] < '0' || buf[p] > '9') { return(-1); }
+   
+   while (p < len && buf[p] >= '0' && buf[p] <= '9') {
+      v = v*10 + (buf[p] - '0');
+      if (v > max) { return(-1); }
+      p++;
    }
+   
+   // A number must be terminated by whitespace or a comment
+   if (p >= len) { return(-1); }
+   if (buf[p] != '#' && buf[p] != ' ' && buf[p] != '\t' && buf[p] != '\n' && 
+       buf[p] != '\r' && buf[p] != '\v' && buf[p] != '\f') { return(-1); }
+
+   *value = v;
+   *pos = p;
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function parses the keyword header of a PAM (P7) image held in
+   memory.  The header is a list of WIDTH, HEIGHT, DEPTH, MAXVAL and TUPLTYPE
+   lines closed by ENDHDR, the raster is binary like P5/P6 with DEPTH
+   samples per pixel.
+   
+      const unsigned char *buf   - Start of the file
+      size_t len                 - Number of valid bytes in buf
+      PPMHeader *hdr             - Returned header fields
+  
+   Returns: const char *  NULL on success, otherwise an error message
+   
+   Error Handling:   returns an error message
+----------------------------------------------------------------------------*/
+static const char *parse_pam_header(const unsigned char *buf, size_t len, PPMHeader *hdr) {
+   static const char *tupltypes[] = { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+   size_t pos = 2, start, end;
+   long x = 0, y = 0, depth = 0, maxval = 0;
+   const char *tupltype = NULL;
+   int i;
+
+   for (;;) {
+      pos = skip_header_space(buf, len, pos);
+      start = pos;
+      while (pos < len && ((buf[pos] >= 'A' && buf[pos] <= 'Z') || buf[pos] == '_')) { pos++; }
+
+      if (pos >= len) {
+         return("Header too long");
+      }
+      else if (pos - start == 6 && !memcmp(buf + start, "ENDHDR", 6)) {
+         while (pos < len && buf[pos] != '\n') { pos++; }
+         if (pos >= len) { return("Header too long"); }
+         pos++;
+         break;
+      }
+      else if (pos - start == 5 && !memcmp(buf + start, "WIDTH", 5)) {
+         if (read_header_number(buf, len, &pos, PPM_MAX_DIMENSION, &x)) { return("Invalid image size"); }
+      }
+      else if (pos - start == 6 && !memcmp(buf + start, "HEIGHT", 6)) {
+         if (read_header_number(buf, len, &pos, PPM_MAX_DIMENSION, &y)) { return("Invalid image size"); }
+      }
+      else if (pos - start == 5 && !memcmp(buf + start, "DEPTH", 5)) {
+         if (read_header_number(buf, len, &pos, MAX_CHANNELS, &depth)) { return("Unsupported depth"); }
+      }
+      else if (pos - start == 6 && !memcmp(buf + start, "MAXVAL", 6)) {
+         if (read_header_number(buf, len, &pos, MAX_COMPONENT_COLOR, &maxval)) { return("Invalid rgb component"); }
+      }
+      else if (pos - start == 8 && !memcmp(buf + start, "TUPLTYPE", 8)) {
+         // The tuple type is the rest of the line
+         while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t')) { pos++; }
+         start = pos;
+         while (pos < len && buf[pos] != '\n' && buf[pos] != '\r') { pos++; }
+         for (end = pos; end > start && (buf[end - 1] == ' ' || buf[end - 1] == '\t'); end--);
 
-   //check for comments
-   c = getc(fp);
-   while (c == '#') {
-      while (getc(fp) != '\n');
-      c = getc(fp);
+         for (i = 0; i < 4; i++) {
+            if (strlen(tupltypes[i]) == end - start && !memcmp(buf + start, tupltypes[i], end - start)) {
+               tupltype = tupltypes[i];
+            }
+         }
+         if (!tupltype) { return("Unsupported tuple type"); }
+      }
+      else {
+         return("Invalid PAM header");
+      }
    }
 
-   ungetc(c, fp);
-   //read image size information
-   if(fscanf(fp, "%d %d", &img->x, &img->y) != 2) {
-      fprintf(stderr, "Invalid image size (error loading '%s')\n", filename);
-      exit(1);
+   if (x == 0 || y == 0) { return("Invalid image size"); }
+   if (maxval == 0) { return("Invalid rgb component"); }
+   if (depth == 0 || (tupltype && tupltypes[depth - 1] != tupltype)) {
+      return("Depth does not match tuple type");
    }
 
-   //read rgb component
-   if(fscanf(fp, "%d", &rgb_comp_color) != 1) {
-      fprintf(stderr, "Invalid rgb component (error loading '%s')\n", filename);
-      exit(1);
+   hdr->channels = (int)depth;
+   hdr->x = (int)x;
+   hdr->y = (int)y;
+   hdr->maxval = (int)maxval;
+   hdr->offset = (off_t)pos;
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+   This function parses a PPM header held in memory.  The whole header is
+   parsed out of one buffer so no stdio calls are needed, and the byte offset
+   of the raster is returned so the pixels can be read with a single pread()
+   or used directly from an mmap.
+   
+      const unsigned char *buf   - Start of the file
+      size_t len                 - Number of valid bytes in buf
+      PPMHeader *hdr             - Returned header fields
+  
+   Returns: const char *  NULL on success, otherwise an error message
+   
+   Error Handling:   returns an error message
+----------------------------------------------------------------------------*/
+static const char *parse_ppm_header(const unsigned char *buf, size_t len, PPMHeader *hdr) {
+   size_t pos;
+   long x, y, maxval;
+
+   //check the image format, P1-P3 are the plain (ASCII) forms of P4-P6
+   if (len < 2 || buf[0] != 'P' || buf[1] < '1' || buf[1] > '7') {
+      return("Invalid image format (must be 'P1' to 'P7')");
+   }
+   hdr->format = buf[1];
+   if (hdr->format == '7') {
+      return(parse_pam_header(buf, len, hdr));
    }
+   hdr->channels = (buf[1] == '6' || buf[1] == '3') ? 3 : 1;
+   pos = 2;
 
-   //check rgb component depth
-   if(rgb_comp_color!= RGB_COMPONENT_COLOR) {
-      fprintf(stderr, "'%s' error only RGB supported\n", filename);
-      exit(1);
+   //read image size information
+   if (read_header_number(buf, len, &pos, PPM_MAX_DIMENSION, &x) || 
+       read_header_number(buf, len, &pos, PPM_MAX_DIMENSION, &y) || x == 0 || y == 0) {
+      return("Invalid image size");
    }
 
-   while (fgetc(fp) != '\n');
-   //memory allocation for pixel data
-   img->data = (PPMPixel*)malloc(img->x * img->y * sizeof(PPMPixel));
+   //read rgb component, bitmaps have none and are unpacked to 0/255 gray
+   if (hdr->format == '4' || hdr->format == '1') {
+      maxval = RGB_COMPONENT_COLOR;
+   }
+   else if (read_header_number(buf, len, &pos, MAX_COMPONENT_COLOR, &maxval) || maxval == 0) {
+      return("Invalid rgb component");
+   }
 
-   if(!img) {
-      fprintf(stderr, "Unable to allocate memory\n");
-      exit(1);
+   // A comment may still sit before the single whitespace ending the header
+   if (buf[pos] == '#') {
+      while (pos < len && buf[pos] != '\n' && buf[pos] != '\r') { pos++; }
+      if (pos >= len) { return("Header too long"); }
    }
+   pos++;
 
-   //read pixel data from file
-   if(fread(img->data, 3 * img->x, img->y, fp) != img->y) {
-      fprintf(stderr, "Error loading image '%s'\n", filename);
-      exit(1);
+   hdr->x = (int)x;
+   hdr->y = (int)y;
+   hdr->maxval = (int)maxval;
+   hdr->offset = (off_t)pos;
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+   These functions read or write exactly size bytes at a file offset,
+   retrying short reads and writes.
+   
+      int fd         - Open file
+      void *buf      - Destination buffer
+      const void *buf - Bytes to write
+      size_t size    - Number of bytes to read or write
+      off_t offset   - File offset to read from or write to
+  
+   Returns: int  0 on success, -1 on an error or, reading, end of file
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int pread_full(int fd, void *buf, size_t size, off_t offset) {
+   size_t done;
+   ssize_t got;
+
+   for (done = 0; done < size; done += (size_t)got) {
+      got = pread(fd, (unsigned char *)buf + done, size - done, offset + (off_t)done);
+      if (got <= 0) { return(-1); }
    }
+   return(0);
+}
 
-   fclose(fp);
-   return img;
+static int pwrite_full(int fd, const void *buf, size_t size, off_t offset) {
+   size_t done;
+   ssize_t put;
+
+   for (done = 0; done < size; done += (size_t)put) {
+      put = pwrite(fd, (const unsigned char *)buf + done, size - done, offset + (off_t)done);
+      if (put <= 0) { return(-1); }
+   }
+   return(0);
 }
 
+/*---------------------------------------------------------------------------
+   This function unpacks a PBM (P4) bitmap into 8 bit gray in place.  Each
+   packed row is padded to a whole byte and a set bit is black.  The packed
+   raster sits at the start of data and is unpacked back to front so no
+   second buffer is needed.
+   
+      unsigned char *data  - Packed raster, sized for the unpacked image
+      int x, int y         - Image size
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void unpack_pbm(unsigned char *data, int x, int y) {
+   size_t packed = ((size_t)x + 7) / 8;
+   int row, col;
+
+   for (row = y - 1; row >= 0; row--) {
+      const unsigned char *in = data + (size_t)row * packed;
+      unsigned char *out = data + (size_t)row * x;
+
+      for (col = x - 1; col >= 0; col--) {
+         out[col] = ((in[col >> 3] >> (7 - (col & 7))) & 1) ? 0 : RGB_COMPONENT_COLOR;
+      }
+   }
+}
 
 /*---------------------------------------------------------------------------
-   This function allocates an image based on the input size and the resamples
-   size.    
+   This function decodes a plain (P1, P2 or P3) raster.  The whole raster is
+   scanned out of one buffer with an inlined digit loop instead of a fscanf
+   per value, which keeps ASCII input within a small factor of binary.
+   Comments are skipped and values above maxval are rejected.
    
-      PMImage *source   - Pointer to an open input image
-      double scale      - The scale factor to use
+      const unsigned char *buf   - Raster text
+      size_t len                 - Number of bytes in buf
+      PPMImage *img              - Sized image to fill
+      int bitmap                 - Set for P1, single digit 1=black values
   
-   Returns: PPMImage *readPPM    Pointer to a malloced data structure
+   Returns: const char *  NULL on success, otherwise an error message
    
-   Error Handling:   exits with an error code
+   Error Handling:   returns an error message
 ----------------------------------------------------------------------------*/
-static PPMImage *init_destination_image(PPMImage *source, double scale) {
-   PPMImage *img;
-   //alloc memory form image
-   img = (PPMImage *)malloc(sizeof(PPMImage));
-   if(!img) {
+static const char *parse_ascii_raster(const unsigned char *buf, size_t len, PPMImage *img, int bitmap) {
+   size_t count = (size_t)img->x * img->y * img->channels;
+   uint16_t *wide = (uint16_t *)img->data;
+   unsigned int maxval = (unsigned int)img->maxval;
+   unsigned int v, d;
+   size_t n, pos = 0;
 
-     fprintf(stderr, "Unable to allocate memory\n");
-     exit(1);
+   for (n = 0; n < count; n++) {
+      // skip the separators, anything other than whitespace or comments is an error
+      while (pos < len && (unsigned int)(buf[pos] - '0') > 9) {
+         if (buf[pos] == '#') {
+            while (pos < len && buf[pos] != '\n') { pos++; }
+         }
+         else if (buf[pos] == ' ' || (buf[pos] >= '\t' && buf[pos] <= '\r')) {
+            pos++;
+         }
+         else {
+            return("Invalid character in raster");
+         }
+      }
+      if (pos >= len) { return("Truncated image data"); }
+
+      if (bitmap) {
+         v = buf[pos++] - '0';
+         if (v > 1) { return("Invalid bitmap value"); }
+         img->data[n] = v ? 0 : RGB_COMPONENT_COLOR;
+         continue;
+      }
+
+      v = 0;
+      while (pos < len && (d = (unsigned int)(buf[pos] - '0')) <= 9) {
+         v = v*10 + d;
+         if (v > maxval) { return("Sample larger than maxval"); }
+         pos++;
+      }
+      if (maxval > RGB_COMPONENT_COLOR) { wide[n] = (uint16_t)v; }
+      else                              { img->data[n] = (uint8_t)v; }
    }
+   return(NULL);
+}
 
-   //memory allocation for pixel data
-    if (debug) { printf("XxY %dx%d scale %d PPM %ld dest size %ld\n", source->x, source->y, (int)scale, 
-                sizeof(PPMPixel*),source->x*(int)(scale+.1)*source->y*(int)(scale+.5)*sizeof(PPMPixel));} 
+/*---------------------------------------------------------------------------
+   These functions keep freed pixel buffers for reuse.  A long running
+   server resamples the same sizes over and over, and reusing the buffers
+   saves the page faults of fresh allocations.  The pool is off unless
+   buffer_pool.enabled is set, then malloc and free are used directly.
+   
+      size_t size    - Bytes needed / bytes in the buffer being returned
+      void *ptr      - Buffer being returned, may be NULL
+  
+   Returns: pool_alloc  Pointer to a buffer of at least size bytes
+   
+   Error Handling:   exits if memory runs out
+----------------------------------------------------------------------------*/
+void *pool_alloc(size_t size) {
+   void *ptr = NULL;
+   int i, best = -1;
 
-   img->data = (PPMPixel*)malloc(source->x*(scale+.1)*source->y*(scale+.5)*sizeof(PPMPixel));
-   if(!img) {
+   if (size == 0) { size = 1; }
+   if (buffer_pool.enabled) {
+      // Take the smallest pooled buffer that fits and wastes under half
+      pthread_mutex_lock(&buffer_pool.lock);
+      for (i = 0; i < buffer_pool.count; i++) {
+         if (buffer_pool.entry[i].size >= size && buffer_pool.entry[i].size / 2 <= size &&
+             (best < 0 || buffer_pool.entry[i].size < buffer_pool.entry[best].size)) {
+            best = i;
+         }
+      }
+      if (best >= 0) {
+         ptr = buffer_pool.entry[best].ptr;
+         buffer_pool.bytes -= buffer_pool.entry[best].size;
+         buffer_pool.entry[best] = buffer_pool.entry[--buffer_pool.count];
+      }
+      pthread_mutex_unlock(&buffer_pool.lock);
+   }
+
+   if (!ptr) { ptr = malloc(size); }
+   if (!ptr) {
       fprintf(stderr, "Unable to allocate memory\n");
       exit(1);
    }
-   return img;
+   return(ptr);
 }
 
+void pool_free(void *ptr, size_t size) {
+   if (!ptr) { return; }
+   if (buffer_pool.enabled) {
+      pthread_mutex_lock(&buffer_pool.lock);
+      if (buffer_pool.count < BUFFER_POOL_ENTRIES && buffer_pool.bytes + size <= BUFFER_POOL_BYTES) {
+         buffer_pool.entry[buffer_pool.count].ptr = ptr;
+         buffer_pool.entry[buffer_pool.count].size = size;
+         buffer_pool.count++;
+         buffer_pool.bytes += size;
+         ptr = NULL;
+      }
+      pthread_mutex_unlock(&buffer_pool.lock);
+   }
+   free(ptr);
+}
 
 /*---------------------------------------------------------------------------
-   Writes a PPM format image file
-      
-      char *filename - The PPM file image name to write 
-      PPMImage *img  - A pointer to an (PPM) image object
-      
-      Returns: nothing
-      
-      Error handling: exit with a return code
+   These functions measure the read, resample and write stages for --stats.
+   Each stage gets its wall time, calls, bytes and pixels, and with Linux
+   perf events the hardware counts of every thread of the program.  Each
+   thread opens its own counters, and a stage adds up the change over all
+   of them, so work done on the workers is counted with the resample.
+   Resample jobs in a batch overlap, so their times can add up to more
+   than the run.
+   
+      StageMark *mark      - Start of a stage, filled by stats_begin
+      int stage            - STAGE_READ, STAGE_RESAMPLE or STAGE_WRITE
+      uint64_t bytes       - Bytes read or written by the stage
+      uint64_t pixels      - Pixels produced by the stage
+      uint64_t counter[]   - Returned sum of each counter over the threads
+  
+   Returns: nothing
+   
+   Error Handling:   counters that can't be opened are left out
 ----------------------------------------------------------------------------*/
-void writePPM(const char *filename, PPMImage *img) {
-   FILE *fp;
-   //open file for output
-   fp = fopen(filename, "wb");
+static void stats_open_counters(void) {
+#ifdef __linux__
+   static const uint64_t config[PERF_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+   };
+   struct perf_event_attr attr;
+   int fd[PERF_COUNTERS], *grown, kept, i;
+
+   if (!stats.enabled || stats.counters < 0) { return; }
+
+   // Count this thread in user space only, which needs no privileges
+   for (i = 0; i < PERF_COUNTERS; i++) {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[i];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+   }
+
+   for (i = 0, kept = 1; i < PERF_COUNTERS; i++) {
+      if (fd[i] < 0) { kept = 0; }
+   }
+
+   pthread_mutex_lock(&stats.lock);
+   if (!kept) {
+      stats.counters = -1;
+   }
+   else {
+      grown = (int *)realloc(stats.fd, (stats.threads + 1) * PERF_COUNTERS * sizeof(int));
+      kept = (grown != NULL);
+      if (kept) {
+         stats.fd = grown;
+         memcpy(stats.fd + stats.threads * PERF_COUNTERS, fd, sizeof(fd));
+         stats.threads++;
+         stats.counters = 1;
+      }
+   }
+   pthread_mutex_unlock(&stats.lock);
+
+   for (i = 0; i < PERF_COUNTERS && !kept; i++) {
+      if (fd[i] >= 0) { close(fd[i]); }
+   }
+#endif
+}
+
+static void stats_read_counters(uint64_t counter[]) {
+   uint64_t value;
+   int t, i;
+
+   memset(counter, 0, PERF_COUNTERS * sizeof(uint64_t));
+   pthread_mutex_lock(&stats.lock);
+   for (t = 0; t < stats.threads; t++) {
+      for (i = 0; i < PERF_COUNTERS; i++) {
+         if (read(stats.fd[t * PERF_COUNTERS + i], &value, sizeof(value)) == sizeof(value)) {
+            counter[i] += value;
+         }
+      }
+   }
+   pthread_mutex_unlock(&stats.lock);
+}
+
+static void stats_begin(StageMark *mark) {
+   if (!stats.enabled) { return; }
+   stats_read_counters(mark->counter);
+   clock_gettime(CLOCK_MONOTONIC, &mark->start);
+}
+
+static void stats_end(int stage, const StageMark *mark, uint64_t bytes, uint64_t pixels) {
+   uint64_t counter[PERF_COUNTERS];
+   struct timespec now;
+   StageStats *s = &stats.stage[stage];
+   int i;
+
+   if (!stats.enabled) { return; }
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   stats_read_counters(counter);
+
+   pthread_mutex_lock(&stats.lock);
+   s->calls++;
+   s->seconds += (now.tv_sec - mark->start.tv_sec) + (now.tv_nsec - mark->start.tv_nsec) * 1e-9;
+   s->bytes += bytes;
+   s->pixels += pixels;
+   for (i = 0; i < PERF_COUNTERS; i++) {
+      s->counter[i] += counter[i] - mark->counter[i];
+   }
+   pthread_mutex_unlock(&stats.lock);
+}
+
+/*---------------------------------------------------------------------------
+   This function writes the --stats results as JSON and closes the counters
+   
+      const char *filename - File to write, "-" for stdout
+  
+   Returns: nothing
+   
+   Error Handling:   exits if the file can't be written
+----------------------------------------------------------------------------*/
+static void write_stats(const char *filename) {
+   static const char *stage_name[STAGE_COUNT] = { "read", "resample", "write", "total" };
+   static const char *counter_name[PERF_COUNTERS] = {
+      "cycles", "instructions", "cache_misses", "branch_misses"
+   };
+   FILE *fp = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+   int s, i;
+
+   if (!fp) {
+      fprintf(stderr, "Unable to open file '%s'\n", filename);
+      exit(1);
+   }
+
+   fprintf(fp, "{\n  \"counters\": %s,\n  \"threads\": %d,\n  \"stages\": {\n",
+           (stats.counters > 0) ? "true" : "false", stats.threads);
+   for (s = 0; s < STAGE_COUNT; s++) {
+      const StageStats *st = &stats.stage[s];
+
+      fprintf(fp, "    \"%s\": { \"calls\": %llu, \"seconds\": %.6f, \"bytes\": %llu, \"pixels\": %llu",
+              stage_name[s], (unsigned long long)st->calls, st->seconds,
+              (unsigned long long)st->bytes, (unsigned long long)st->pixels);
+      for (i = 0; i < PERF_COUNTERS; i++) {
+         if (stats.counters > 0) { fprintf(fp, ", \"%s\": %llu", counter_name[i], (unsigned long long)st->counter[i]); }
+         else                    { fprintf(fp, ", \"%s\": null", counter_name[i]); }
+      }
+      fprintf(fp, " }%s\n", (s + 1 < STAGE_COUNT) ? "," : "");
+   }
+   fprintf(fp, "  }\n}\n");
+   if (fp != stdout) { fclose(fp); }
+   else              { fflush(fp); }
+
+   for (i = 0; i < stats.threads * PERF_COUNTERS; i++) {
+      close(stats.fd[i]);
+   }
+   free(stats.fd);
+   stats.fd = NULL;
+   stats.threads = 0;
+}
+
+static void finish_stats(const char *filename, const StageMark *run) {
+   if (filename) {
+      stats_end(STAGE_TOTAL, run, stats.stage[STAGE_READ].bytes + stats.stage[STAGE_WRITE].bytes,
+                stats.stage[STAGE_RESAMPLE].pixels);
+      write_stats(filename);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   This function frees an image and its pixel data
+   
+      PPMImage *img  - Image to free, may be NULL
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+void free_image(PPMImage *img) {
+   if (img) {
+      pool_free(img->data, image_size(img));
+      free(img);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   This function reads bytes from an image source, an open file or a buffer
+   already in memory.
+   
+      const PPMSource *src - Where the image comes from
+      void *buf            - Destination buffer
+      size_t size          - Number of bytes to read
+      off_t offset         - Offset to read from
+  
+   Returns: int  0 on success, -1 on a read error or short source
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int source_read(const PPMSource *src, void *buf, size_t size, off_t offset) {
+   if (src->mem) {
+      if ((uint64_t)offset > src->size || src->size - offset < size) { return(-1); }
+      memcpy(buf, src->mem + offset, size);
+      return(0);
+   }
+   return(pread_full(src->fd, buf, size, offset));
+}
+
+/*---------------------------------------------------------------------------
+   This function copies the pixels of one image into another of the same
+   size and format, following the stride of each
+   
+      PPMImage *dst        - Image to copy into
+      const PPMImage *src  - Image to copy
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void copy_image_rows(PPMImage *dst, const PPMImage *src) {
+   size_t row = (size_t)src->x * image_pixel_bytes(src);
+   int y;
+
+   for (y = 0; y < src->y; y++) {
+      memcpy(image_row(dst, y), image_row(src, y), row);
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This function decodes a PPM image from a file or memory source.  Errors
+   are returned rather than exiting so a long running server can reject a
+   bad image and carry on.
+   
+      const PPMSource *src - Where the image comes from
+      const char **err     - Returned error message when NULL is returned
+  
+   Returns: PPMImage *  Pointer to a malloced image, NULL on error
+   
+   Error Handling:   returns NULL and an error message, exits if memory runs out
+----------------------------------------------------------------------------*/
+static PPMImage *load_ppm(const PPMSource *src, const char **err) {
+   unsigned char buff[PPM_HEADER_MAX];
+   size_t got = (src->size < sizeof(buff)) ? (size_t)src->size : sizeof(buff);
+   unsigned char *text;
+   PPMHeader hdr;
+   PPMImage *img;
+   size_t packed;
+   int plain;
+
+   //read and parse the whole header in one go
+   if(source_read(src, buff, got, 0)) {
+      *err = "Error reading header";
+      return(NULL);
+   }
+
+   *err = parse_ppm_header(buff, got, &hdr);
+   if(*err) {
+      return(NULL);
+   }
+
+   // Reject images larger than the file before allocating anything, plain
+   // rasters need at least one byte per bitmap value or two per sample
+   plain = (hdr.format <= '3');
+   if (hdr.format == '1') {
+      packed = (size_t)hdr.x * (size_t)hdr.y;
+   }
+   else if (plain) {
+      packed = (size_t)hdr.x * (size_t)hdr.y * (size_t)hdr.channels * 2 - 1;
+   }
+   else if (hdr.format == '4') {
+      packed = ((size_t)hdr.x + 7) / 8 * (size_t)hdr.y;
+   }
+   else {
+      packed = (size_t)hdr.x * (size_t)hdr.y * (size_t)hdr.channels;
+      if (hdr.maxval > RGB_COMPONENT_COLOR) { packed *= 2; }
+   }
+   if((uint64_t)hdr.offset > src->size || src->size - hdr.offset < packed) {
+      *err = "Truncated image data";
+      return(NULL);
+   }
+
+   //alloc memory form image
+   img = (PPMImage *)malloc(sizeof(PPMImage));
+   if(!img) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   img->x = hdr.x;
+   img->y = hdr.y;
+   img->channels = hdr.channels;
+   img->maxval = hdr.maxval;
+   img->stride = 0;
+   img->top = 0;
+
+   //memory allocation for pixel data
+   img->data = (unsigned char *)pool_alloc(image_size(img));
+
+   //plain rasters are scanned from one buffer, in place for memory sources
+   if (plain) {
+      packed = (size_t)(src->size - hdr.offset);
+      text = src->mem ? NULL : (unsigned char *)malloc(packed);
+      if(!src->mem && !text) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+      }
+      if(text && source_read(src, text, packed, hdr.offset)) {
+         *err = "Error loading image";
+      }
+      else {
+         *err = parse_ascii_raster(text ? text : src->mem + hdr.offset, packed, img, hdr.format == '1');
+      }
+      free(text);
+   }
+   //read pixel data from file
+   else if(source_read(src, img->data, packed, hdr.offset)) {
+      *err = "Error loading image";
+   }
+   if(*err) {
+      free_image(img);
+      return(NULL);
+   }
+
+   if (hdr.format == '4') {
+      unpack_pbm(img->data, img->x, img->y);
+   }
+   else if (!plain) {
+      if (image_wide(img)) {
+         swap_samples16((uint16_t *)img->data, (uint16_t *)img->data, packed / 2);
+      }
+      *err = check_maxval(img->data, (size_t)img->x * img->y * img->channels, img->maxval);
+      if (*err) {
+         free_image(img);
+         return(NULL);
+      }
+   }
+
+   return img;
+}
+
+/*---------------------------------------------------------------------------
+   This function reads a PPM image and returns the binary pixel data 
+   in a single 1D array.    
+   
+   const char *filename - File name to open
+  
+   Returns: PPMImage *readPPM    Pointer to a mallloced data structure
+   
+   Error Handling:   exits with an error code
+----------------------------------------------------------------------------*/
+static PPMImage *readPPM(const char *filename) {
+   PPMSource src = { -1, NULL, 0 };
+   PPMImage *img;
+   StageMark mark;
+   struct stat st;
+   const char *err;
+
+   stats_begin(&mark);
+   //open PPM file for reading
+   src.fd = open(filename, O_RDONLY);
+   if(src.fd < 0 || fstat(src.fd, &st)) {
+      fprintf(stderr, "Unable to open file '%s'\n", filename);
+      exit(1);
+   }
+   src.size = (uint64_t)st.st_size;
+
+   img = load_ppm(&src, &err);
+   if(!img) {
+      fprintf(stderr, "%s (error loading '%s')\n", err, filename);
+      exit(1);
+   }
+
+   close(src.fd);
+   stats_end(STAGE_READ, &mark, src.size, 0);
+   return img;
+}
+
+
+/*---------------------------------------------------------------------------
+   These functions size an image from the input size and the scale.  Gray
+   output has one channel, the chroma planes of YCbCr 4:2:0 output are two
+   channels of half the size rounded up.  size_destination fills in the
+   size and format alone, for images written in strips, and
+   init_destination_image also allocates the pixel data.
+   
+      const PPMImage *source  - Input image, only its size and format are used
+      double scale            - The scale factor to use
+      int output              - OUTPUT_RGB, OUTPUT_GRAY or OUTPUT_CHROMA
+      PPMImage *img           - Returned size and format, data is left alone
+  
+   Returns: size_destination        nothing
+            init_destination_image  Pointer to a malloced image
+   
+   Error Handling:   init_destination_image exits if memory runs out
+----------------------------------------------------------------------------*/
+static void size_destination(const PPMImage *source, double scale, int output, PPMImage *img) {
+   img->channels = source->channels;
+   img->maxval = source->maxval;
+   img->stride = 0;
+   img->top = 0;
+   img->x = (long)((double)(source->x)*scale);
+   img->y = (long)((double)(source->y)*scale);
+   if (output == OUTPUT_GRAY) {
+      img->channels = 1;
+   }
+   else if (output == OUTPUT_CHROMA) {
+      img->channels = 2;
+      img->x = (img->x + 1) / 2;
+      img->y = (img->y + 1) / 2;
+   }
+}
+
+static PPMImage *init_destination_image(PPMImage *source, double scale, int output) {
+   PPMImage *img;
+   //alloc memory form image
+   img = (PPMImage *)malloc(sizeof(PPMImage));
+   if(!img) {
+
+     fprintf(stderr, "Unable to allocate memory\n");
+     exit(1);
+   }
+   size_destination(source, scale, output, img);
+
+   //memory allocation for pixel data, exactly the resampled size
+   TRACE_PRINTF("XxY %dx%d scale %g pixel bytes %ld dest size %ld\n", source->x, source->y, scale,
+                (long)image_pixel_bytes(img), (long)image_size(img));
+
+   img->data = (unsigned char *)pool_alloc(image_size(img));
+   return img;
+}
+
+/*---------------------------------------------------------------------------
+   These functions handle the factors that name a quick kernel rather than
+   a scale, "2x" down samples by 2, "2up" and "4up" up sample by 2 and 4
+   
+      const char *factor   - Factor as given
+      double scale         - Factor as a number
+      int size             - Source width or height
+      const ResampleOptions *opts - Resampling options
+  
+   Returns: quick_up      2 or 4 for the up samples, else 0
+            is_quick      1 for any quick kernel, else 0
+            factor_size   The destination width or height
+            output_fits   1 if the destination is 1 to PPM_MAX_DIMENSION pixels
+                          on each side, else 0
+            option_conflict  NULL if the options can be used with the factor,
+                          else why not.  Only the tiled float engine sharpens and
+                          only scales convert or warp the output
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static int quick_up(const char *factor) {
+   if (strcmp(factor, "2up") == 0) { return(2); }
+   if (strcmp(factor, "4up") == 0) { return(4); }
+   return(0);
+}
+
+static int is_quick(const char *factor) {
+   return(strcmp(factor, "2x") == 0 || quick_up(factor));
+}
+
+static long factor_size(const char *factor, double scale, int size) {
+   if (strcmp(factor, "2x") == 0) { return(size / 2); }
+   if (quick_up(factor)) { return((long)size * quick_up(factor)); }
+   return((long)((double)size * scale));
+}
+
+static int output_fits(const char *factor, double scale, const PPMImage *source) {
+   long x = factor_size(factor, scale, source->x), y = factor_size(factor, scale, source->y);
+
+   return(x >= 1 && y >= 1 && x <= PPM_MAX_DIMENSION && y <= PPM_MAX_DIMENSION);
+}
+
+static const char *option_conflict(const char *factor, const ResampleOptions *opts) {
+   if (opts->output != OUTPUT_RGB && is_quick(factor)) {
+      return("output gray and ycbcr420 need a scale, not a quick factor");
+   }
+   if (opts->warp != WARP_NONE && is_quick(factor)) { return("warps need a scale, not a quick factor"); }
+   if (opts->warp != WARP_NONE && opts->amount > 0.0) { return("sharpen does not work with warps"); }
+   if (opts->amount <= 0.0) { return(NULL); }
+   if (is_quick(factor)) { return("sharpen needs a scale, not a quick factor"); }
+   if (opts->tile_x < 0) { return("sharpen needs tiles, not tile off"); }
+   if (opts->engine != ENGINE_FLOAT) { return("sharpen needs the float engine"); }
+   return(NULL);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function writes a plain (P2 or P3) raster.  Values are formatted by
+   hand into one buffer and written in large blocks, lines are kept under the
+   70 characters the format allows.
+      
+      FILE *fp       - Open output file
+      PPMImage *img  - A pointer to an (PPM) image object
+      
+      Returns: nothing
+      
+      Error handling: none
+----------------------------------------------------------------------------*/
+static void write_ascii_raster(FILE *fp, PPMImage *img) {
+   char buff[ASCII_BUFFER_SIZE];
+   size_t per_line = (size_t)img->channels * img->x;
+   size_t count = per_line * img->y;
+   size_t n, used = 0;
+   const unsigned char *row = img->data;
+   int line = 0;
+
+   for (n = 0; n < count; n++) {
+      unsigned int v;
+      char digits[5];
+      int len = 0;
+
+      if (n % per_line == 0) { row = image_row(img, (int)(n / per_line)); }
+      v = image_wide(img) ? ((const uint16_t *)row)[n % per_line] : row[n % per_line];
+      do { digits[len++] = (char)('0' + v % 10); v /= 10; } while (v);
+
+      // Start a new line at the end of each row or before 70 characters
+      if (line && (n % per_line == 0 || line + len + 1 > 70)) {
+         buff[used++] = '\n';
+         line = 0;
+      }
+      else if (line) {
+         buff[used++] = ' ';
+         line++;
+      }
+      line += len;
+      while (len) { buff[used++] = digits[--len]; }
+
+      if (used > sizeof(buff) - 8) {
+         fwrite(buff, 1, used, fp);
+         used = 0;
+      }
+   }
+   buff[used++] = '\n';
+   fwrite(buff, 1, used, fp);
+}
+
+
+/*---------------------------------------------------------------------------
+   Writes the header of a PPM format image to an open stream, write_ppm_stream
+   follows it with the pixels
+      
+      FILE *fp             - Open output stream
+      const PPMImage *img  - Image to describe, only the size and format are used
+      int ascii            - Write plain P2/P3 rather than binary
+      
+      Returns: nothing
+      
+      Error handling: none
+----------------------------------------------------------------------------*/
+static void write_ppm_header(FILE *fp, const PPMImage *img, int ascii) {
+   //images with alpha can only be written as binary PAM
+   if (HAS_ALPHA(img->channels)) {
+      fprintf(fp, "P7\n# Created by %s\n", CREATOR);
+      fprintf(fp, "WIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\n", img->x, img->y, img->channels, img->maxval);
+      fprintf(fp, "TUPLTYPE %s\nENDHDR\n", (img->channels == 2) ? "GRAYSCALE_ALPHA" : "RGB_ALPHA");
+   }
+   else {
+      //write the header file as ascii data on each line
+      //image format, single channel images are written as gray
+      if (ascii)        { fprintf(fp, "%s\n", (img->channels == 1) ? "P2" : "P3"); }
+      else              { fprintf(fp, "%s\n", (img->channels == 1) ? "P5" : "P6"); }
+
+      //comments
+      fprintf(fp, "# Created by %s\n",CREATOR);
+
+      //image size
+      fprintf(fp, "%d %d\n",img->x,img->y);
+
+      // rgb component depth
+      fprintf(fp, "%d\n",img->maxval);
+   }
+}
+
+/*---------------------------------------------------------------------------
+   Writes a PPM format image to an open stream, a file or a memory buffer
+      
+      FILE *fp       - Open output stream
+      PPMImage *img  - A pointer to an (PPM) image object
+      int ascii      - Write plain P2/P3 rather than binary
+      
+      Returns: nothing
+      
+      Error handling: none
+----------------------------------------------------------------------------*/
+static void write_ppm_stream(FILE *fp, PPMImage *img, int ascii) {
+   uint16_t swapped[BUFFER_SAMPLES];
+   size_t count, done, n;
+   int y;
+
+   write_ppm_header(fp, img, ascii);
+
+   // pixel data - plain text, or binary with 16 bit samples swapped to big
+   // endian in chunks, a row at a time unless the rows are packed
+   count = (size_t)img->channels * img->x;
+   if (ascii && !HAS_ALPHA(img->channels)) {
+      write_ascii_raster(fp, img);
+   }
+   else if (image_wide(img)) {
+      for (y = 0; y < img->y; y++) {
+         const uint16_t *row = (const uint16_t *)image_row(img, y);
+         for (done = 0; done < count; done += n) {
+            n = (count - done < BUFFER_SAMPLES) ? count - done : BUFFER_SAMPLES;
+            swap_samples16(swapped, row + done, n);
+            fwrite(swapped, sizeof(uint16_t), n, fp);
+         }
+      }
+   }
+   else if (img->stride == 0 || img->stride == count) {
+      fwrite(img->data, count, img->y, fp);
+   }
+   else {
+      for (y = 0; y < img->y; y++) {
+         fwrite(image_row(img, y), 1, count, fp);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+   Writes a PPM format image file
+      
+      char *filename - The PPM file image name to write 
+      PPMImage *img  - A pointer to an (PPM) image object
+      
+      Returns: nothing
+      
+      Error handling: exit with a return code
+----------------------------------------------------------------------------*/
+void writePPM(const char *filename, PPMImage *img) {
+   StageMark mark;
+   long bytes;
+   FILE *fp;
+
+   stats_begin(&mark);
+   //open file for output
+   fp = fopen(filename, "wb");
+   if (!fp) {
+       fprintf(stderr, "Unable to open file '%s'\n", filename);
+       exit(1);
+   }
+   write_ppm_stream(fp, img, ascii_output);
+   bytes = ftell(fp);
+   fclose(fp);
+   stats_end(STAGE_WRITE, &mark, (bytes > 0) ? (uint64_t)bytes : 0, 0);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function returns the four Catmull-Rom weights of the samples before,
+   at, after and two after a fractional position
+   
+      double t    - Fractional position, 0..1
+      double w[]  - Returned CUBIC_TAPS weights, they sum to 1
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static inline void cubic_weights(double t, double w[]) {
+   double t2 = t * t, t3 = t2 * t;
+
+   w[0] = (-t3 + 2.0*t2 - t) / 2.0;
+   w[1] = (3.0*t3 - 5.0*t2 + 2.0) / 2.0;
+   w[2] = (-3.0*t3 + 4.0*t2 + t) / 2.0;
+   w[3] = (t3 - t2) / 2.0;
+}
+
+/*---------------------------------------------------------------------------
+   These functions convert between sRGB encoded and linear light values,
+   both normalized to 0..1
+   
+      double v    - Value to convert
+  
+   Returns: double converted value
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static double srgb_to_linear(double v) {
+   return((v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+}
+
+static double linear_to_srgb(double v) {
+   return((v <= 0.0031308) ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055);
+}
+
+/*---------------------------------------------------------------------------
+   This function builds the lookup tables used for linear light resampling.
+   Decoding sRGB is one table read per sample, and for samples up to 8 bit
+   encoding back is a read from a finely spaced table indexed by the linear
+   value, so neither needs a pow() per sample in the kernels.  Wider samples
+   use the formula on the way out since a table fine enough would not fit in
+   cache.
+   
+      int maxval     - Largest sample value of the image
+  
+   Returns: LinearTables *  Pointer to a malloced set of tables
+   
+   Error Handling:   exits with an error code
+----------------------------------------------------------------------------*/
+static LinearTables *init_linear_tables(int maxval) {
+   LinearTables *lin;
+   int i;
+
+   lin = (LinearTables *)malloc(sizeof(LinearTables));
+   if (!lin) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   lin->maxval = maxval;
+   lin->to_linear = (float *)malloc(((size_t)maxval + 1) * sizeof(float));
+   lin->to_srgb = NULL;
+   if (!lin->to_linear) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   for (i = 0; i <= maxval; i++) {
+      lin->to_linear[i] = (float)(srgb_to_linear((double)i / maxval) * maxval);
+   }
+
+   if (maxval <= RGB_COMPONENT_COLOR) {
+      lin->to_srgb = (uint8_t *)malloc(LINEAR_LUT_SIZE);
+      if (!lin->to_srgb) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+      }
+      for (i = 0; i < LINEAR_LUT_SIZE; i++) {
+         lin->to_srgb[i] = (uint8_t)(linear_to_srgb((double)i / (LINEAR_LUT_SIZE - 1)) * maxval + 0.5);
+      }
+   }
+   return(lin);
+}
+
+static void free_linear_tables(LinearTables *lin) {
+   if (lin) {
+      free(lin->to_linear);
+      free(lin->to_srgb);
+      free(lin);
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This functio returns a pixel sample array for the data at the given point x,y*
+  BUT will never exceed the array bounds so it handles the edge effect.
+  
+      PPMImage *source_image  - Pointer to an images
+      int x, int y            - Image x,y coordinates
+      double temp[]           - Pointer to a channels array to return data,
+                                color is premultiplied when there is alpha
+      const LinearTables *lin - Tables to decode color to linear light, or NULL
+      const int channels      - Samples per pixel, a constant in the kernels
+      const int wide          - Set for 16 bit samples, a constant in the kernels
+
+   return: nothing
+   
+   Error handling: none
+----------------------------------------------------------------------------*/
+static inline void get_pixel_clamped_n(PPMImage *source_image, int x, int y, double temp[],
+                                       const LinearTables *lin, const int channels, const int wide)  {
+   const unsigned char *row;
+   size_t offset;
+   int i;
+
+   // Keep from exceeding the array index
+   CLAMP(x, 0, source_image->x - 1);
+   CLAMP(y, 0, source_image->y - 1);
+   
+   row = image_row(source_image, y);
+   offset = (size_t)x * channels;
+   for (i = 0; i < channels; i++) {
+      unsigned int s = wide ? ((const uint16_t *)row)[offset + i] : row[offset + i];
+
+      // Alpha is already linear
+      if (lin && !(HAS_ALPHA(channels) && i == channels - 1)) { temp[i] = lin->to_linear[s]; }
+      else                                                     { temp[i] = s; }
+   }
+
+   // Color is interpolated premultiplied by alpha so clear pixels don't bleed
+   if (HAS_ALPHA(channels)) {
+      for (i = 0; i < channels - 1; i++) {
+         temp[i] = temp[i] * temp[channels - 1] / source_image->maxval;
+      }
+   }
+}
+
+void get_pixel_clamped(PPMImage *source_image, int x, int y, double temp[], const LinearTables *lin)  {
+   DISPATCH_FORMAT(source_image, get_pixel_clamped_n, source_image, x, y, temp, lin);
+}
+
+/*---------------------------------------------------------------------------
+  This function converts an interpolated pixel back to samples.  Values are
+  clamped to maxval, for formats with alpha the premultiplied color is
+  divided back out by the interpolated alpha, and in linear light mode color
+  is encoded back to sRGB.
+
+      double value[]          - Interpolated channels, premultiplied with alpha
+      uint16_t sample[]       - Returned pixel, one sample per channel
+      double maxval           - Largest sample value
+      const LinearTables *lin - Tables to encode color back to sRGB, or NULL
+      const int channels      - Samples per pixel, alpha is last when even
+
+   return: nothing
+   
+   Error handling: none
+----------------------------------------------------------------------------*/
+static inline void store_pixel_n(double value[], uint16_t sample[], double maxval, 
+                                 const LinearTables *lin, const int channels) {
+   int i;
+
+   // A NaN position (one pixel wide destination) also ends up as 0
+   for (i = 0; i < channels; i++) {
+      if (!(value[i] >= 0.0)) { value[i] = 0.0; }
+      else if (value[i] > maxval) { value[i] = maxval; }
+   }
+
+   if (HAS_ALPHA(channels)) {
+      double alpha = value[channels - 1];
+
+      for (i = 0; i < channels - 1; i++) {
+         value[i] = (alpha > 0.0) ? value[i] * maxval / alpha : 0.0;
+         if (value[i] > maxval) { value[i] = maxval; }
+      }
+   }
+
+   for (i = 0; i < channels; i++) {
+      if (!lin || (HAS_ALPHA(channels) && i == channels - 1)) {
+         sample[i] = (uint16_t)value[i];
+      }
+      else if (lin->to_srgb) {
+         sample[i] = lin->to_srgb[(int)(value[i] / maxval * (LINEAR_LUT_SIZE - 1) + 0.5)];
+      }
+      else {
+         sample[i] = (uint16_t)(linear_to_srgb(value[i] / maxval) * maxval + 0.5);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+  This function writes one resampled pixel into a destination row, as it
+  is or converted to luma or to the Cb and Cr samples of the output mode.
+  The conversion is full range BT.601, as JPEG uses, applied to the stored
+  samples so it gives the same result as converting the RGB output.  Gray
+  sources have neutral chroma and alpha is dropped.
+
+      unsigned char *row      - Destination row
+      size_t x                - Destination pixel
+      const uint16_t sample[] - Samples from store_pixel_n
+      int maxval              - Largest sample value
+      int output              - OUTPUT_RGB, OUTPUT_GRAY or OUTPUT_CHROMA
+      const int channels      - Source samples per pixel
+      const int wide          - Set for 16 bit samples
+
+   return: nothing
+   
+   Error handling: none
+----------------------------------------------------------------------------*/
+static inline void put_pixel_n(unsigned char *row, size_t x, const uint16_t sample[], int maxval,
+                               int output, const int channels, const int wide) {
+   double r = sample[0], g = (channels >= 3) ? sample[1] : r, b = (channels >= 3) ? sample[2] : r;
+   double half = (maxval + 1) / 2, v[2];
+   int i, count = (output == OUTPUT_CHROMA) ? 2 : 1;
+
+   if (output == OUTPUT_RGB) {
+      for (i = 0; i < channels; i++) {
+         if (wide) { ((uint16_t *)row)[x*channels + i] = sample[i]; }
+         else      { row[x*channels + i] = (uint8_t)sample[i]; }
+      }
+      return;
+   }
+
+   if (output == OUTPUT_GRAY) {
+      v[0] = 0.299 * r + 0.587 * g + 0.114 * b;
+   }
+   else {
+      v[0] = half - 0.168736 * r - 0.331264 * g + 0.5 * b;
+      v[1] = half + 0.5 * r - 0.418688 * g - 0.081312 * b;
+   }
+   for (i = 0; i < count; i++) {
+      v[i] += 0.5;
+      CLAMP(v[i], 0.0, maxval);
+      if (wide) { ((uint16_t *)row)[x*count + i] = (uint16_t)v[i]; }
+      else      { row[x*count + i] = (uint8_t)v[i]; }
+   }
+}
+
+#ifdef TRACE
+/*---------------------------------------------------------------------------
+  This function prints one output pixel for trace builds
+  
+      int x, y                - Destination pixel
+      const uint16_t sample[] - Sample values
+      int channels            - Samples per pixel
+  
+  return: nothing
+  
+  Error handling: none
+----------------------------------------------------------------------------*/
+static void trace_sample(int x, int y, const uint16_t sample[], int channels) {
+   int i;
+
+   printf("x,y %d,%d sample[]=", x, y);
+   for (i = 0; i < channels; i++) { printf("%s%d", i ? " " : "", sample[i]); }
+   printf("\n");
+}
+#endif
+
+/*---------------------------------------------------------------------------
+  This function bicubic samples the source image around a source pixel with
+  the cubic weights of the fractional position past it.  The channel count
+  and sample width are constants so each caller gets a dedicated kernel for
+  every pixel format.
+
+      PPMImage *source_image  - Pointer to an images
+      int xint, int yint      - Source pixel at or before the position
+      const double wx[]       - cubic_weights of the fraction across
+      const double wy[]       - cubic_weights of the fraction down
+      uint16_t sample[]       - Returned pixel, one sample per channel
+      const LinearTables *lin - Tables for linear light resampling, or NULL
+      const int channels      - Samples per pixel
+      const int wide          - Set for 16 bit samples
+
+   return: nothing
+   
+   Error handling: none
+----------------------------------------------------------------------------*/
+static inline void sample_bicubic_n(PPMImage *source_image, int xint, const double wx[], int yint,
+                                    const double wy[], uint16_t sample[], const LinearTables *lin,
+                                    const int channels, const int wide) {
+   double maxval = source_image->maxval;
+   double value[MAX_CHANNELS];
+   int i;
+
+   double p00[MAX_CHANNELS], p10[MAX_CHANNELS], p20[MAX_CHANNELS], p30[MAX_CHANNELS];
+   double p01[MAX_CHANNELS], p11[MAX_CHANNELS], p21[MAX_CHANNELS], p31[MAX_CHANNELS];
+   double p02[MAX_CHANNELS], p12[MAX_CHANNELS], p22[MAX_CHANNELS], p32[MAX_CHANNELS];
+   double p03[MAX_CHANNELS], p13[MAX_CHANNELS], p23[MAX_CHANNELS], p33[MAX_CHANNELS];
+   
+   // 1st row
+   get_pixel_clamped_n(source_image, xint - 1, yint - 1, p00, lin, channels, wide);   
+   get_pixel_clamped_n(source_image, xint + 0, yint - 1, p10, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 1, yint - 1, p20, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 2, yint - 1, p30, lin, channels, wide);
+   
+   // 2nd row
+   get_pixel_clamped_n(source_image, xint - 1, yint + 0, p01, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 0, yint + 0, p11, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 1, yint + 0, p21, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 2, yint + 0, p31, lin, channels, wide);
+
+   // 3rd row
+   get_pixel_clamped_n(source_image, xint - 1, yint + 1, p02, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 0, yint + 1, p12, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 1, yint + 1, p22, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 2, yint + 1, p32, lin, channels, wide);
+
+   // 4th row
+   get_pixel_clamped_n(source_image, xint - 1, yint + 2, p03, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 0, yint + 2, p13, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 1, yint + 2, p23, lin, channels, wide);
+   get_pixel_clamped_n(source_image, xint + 2, yint + 2, p33, lin, channels, wide);
+   
+   // interpolate bi-cubically!
+   for (i = 0; i < channels; i++) {
+      double col0 = CUBIC_SUM(wx, p00[i], p10[i], p20[i], p30[i]);
+      double col1 = CUBIC_SUM(wx, p01[i], p11[i], p21[i], p31[i]);
+      double col2 = CUBIC_SUM(wx, p02[i], p12[i], p22[i], p32[i]);
+      double col3 = CUBIC_SUM(wx, p03[i], p13[i], p23[i], p33[i]);
+  
+      value[i] = CUBIC_SUM(wy, col0, col1, col2, col3);
+   }
+   store_pixel_n(value, sample, maxval, lin, channels);
+}
+
+/*---------------------------------------------------------------------------
+  This function is sample_bicubic_n for a source pixel at least one pixel
+  in from the left and top and two from the right and bottom, so none of
+  the 16 taps need clamping.  Each tap row is read straight from its row
+  pointer and the sums are done in the same order, so the result is the
+  same to the bit.
+
+      PPMImage *source_image  - Pointer to an images
+      int xint, int yint      - Source pixel at or before the position
+      const double wx[]       - cubic_weights of the fraction across
+      const double wy[]       - cubic_weights of the fraction down
+      uint16_t sample[]       - Returned pixel, one sample per channel
+      const LinearTables *lin - Tables for linear light resampling, or NULL
+      const int channels      - Samples per pixel
+      const int wide          - Set for 16 bit samples
+
+   return: nothing
+
+   Error handling: none
+----------------------------------------------------------------------------*/
+static inline void sample_inside_n(PPMImage *source_image, int xint, const double wx[], int yint,
+                                   const double wy[], uint16_t sample[], const LinearTables *lin,
+                                   const int channels, const int wide) {
+   double maxval = source_image->maxval;
+   double col[CUBIC_TAPS][MAX_CHANNELS], p[CUBIC_TAPS][MAX_CHANNELS], value[MAX_CHANNELS];
+   size_t offset = (size_t)(xint - 1) * channels;
+   int i, j, k;
+
+   for (j = 0; j < CUBIC_TAPS; j++) {
+      const unsigned char *row = image_row(source_image, yint - 1 + j);
+
+      for (k = 0; k < CUBIC_TAPS; k++) {
+         for (i = 0; i < channels; i++) {
+            size_t at = offset + (size_t)k * channels + i;
+            unsigned int s = wide ? ((const uint16_t *)row)[at] : row[at];
+
+            if (lin && !(HAS_ALPHA(channels) && i == channels - 1)) { p[k][i] = lin->to_linear[s]; }
+            else                                                     { p[k][i] = s; }
+         }
+         if (HAS_ALPHA(channels)) {
+            for (i = 0; i < channels - 1; i++) {
+               p[k][i] = p[k][i] * p[k][channels - 1] / source_image->maxval;
+            }
+         }
+      }
+      for (i = 0; i < channels; i++) {
+         col[j][i] = CUBIC_SUM(wx, p[0][i], p[1][i], p[2][i], p[3][i]);
+      }
+   }
+   for (i = 0; i < channels; i++) {
+      value[i] = CUBIC_SUM(wy, col[0][i], col[1][i], col[2][i], col[3][i]);
+   }
+   store_pixel_n(value, sample, maxval, lin, channels);
+}
+
+/*---------------------------------------------------------------------------
+  This function bicubic samples the source image at the normalized u,v
+  position using the kernel matching the image pixel format.  0 and 1 are
+  the outer edges of the image, so pixel x is centered at (x + 0.5) / width.
+
+      PPMImage *source_image  - Pointer to an images
+      double u, double v      - Normalized 0..1 sample position
+      uint16_t sample[]       - Returned pixel, one sample per channel
+      const LinearTables *lin - Tables for linear light resampling, or NULL
+
+   return: nothing
+   
+   Error handling: none
+----------------------------------------------------------------------------*/
+void sample_bicubic(PPMImage *source_image, double u, double v, uint16_t sample[], const LinearTables *lin) {
+   double x = u * source_image->x - 0.5, y = v * source_image->y - 0.5;
+   double wx[CUBIC_TAPS], wy[CUBIC_TAPS];
+   int xint = (int)floor(x), yint = (int)floor(y);
+
+   cubic_weights(x - xint, wx);
+   cubic_weights(y - yint, wy);
+   DISPATCH_FORMAT(source_image, sample_bicubic_n, source_image, xint, wx, yint, wy, sample, lin);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function resizes an input image to create a new destination image
+   one pixel at a time using the kernel for a fixed pixel format.  Positions
+   and weights come from the plan so the result matches the tiled engine.
+   
+         const ResamplePlan *plan      - Source positions and weight banks
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - defined output images
+         const LinearTables *lin       - Tables for linear light resampling, or NULL
+         const ImageRect *rect         - Destination pixels to do
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void resize_image_n(const ResamplePlan *plan, PPMImage *source_image,
+                                  PPMImage *destination_image, const LinearTables *lin,
+                                  const ImageRect *rect, int output, const int channels, const int wide) {
+   uint16_t sample[MAX_CHANNELS];
+   int y, x;
+
+   for (y = rect->y0; y < rect->y1; y++) {
+      const double *wy = plan->yweight + (size_t)plan->yphase[y] * CUBIC_TAPS;
+      unsigned char *row = image_row(destination_image, y);
+      
+      for (x = rect->x0; x < rect->x1; ++x) {
+         const double *wx = plan->xweight + (size_t)plan->xphase[x] * CUBIC_TAPS;
+
+         TRACE_PRINTF("src %d phase %d,%d phase %d\n", plan->xint[x], plan->xphase[x],
+                      plan->yint[y], plan->yphase[y]);
+         sample_bicubic_n(source_image, plan->xint[x], wx, plan->yint[y], wy, sample, lin, channels, wide);
+         TRACE_SAMPLE(x, y, sample, channels);
+         put_pixel_n(row, x, sample, source_image->maxval, output, channels, wide);
+      }
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   This function works out the source positions of one axis of a plan and
+   its polyphase weight bank.  Destination pixel i samples source position
+      center:  (i + 0.5) * src / dst - 0.5   pixel areas meet, the default
+      corner:  i * (src - 1) / (dst - 1)     first and last pixel centers meet
+   kept as an exact fraction n / d.  n grows by a constant step per pixel
+   and is carried into the whole part, so there is no division per pixel
+   and every engine gets the same positions.  The phase repeats exactly
+   every d / gcd(step, d) pixels, a rational factor with a short period
+   gets a bank of one weight set per phase that stays in L1, other factors
+   get one set per pixel.
+   
+         int src, dst      - Source and destination size on this axis
+         int align         - ALIGN_CENTER or ALIGN_CORNER
+         int *pos          - Returned source pixel at or before each position
+         int *phase        - Returned weight set of each destination pixel
+         int *phases       - Returned number of weight sets
+   
+   returns: double *  Malloced bank, CUBIC_TAPS weights per phase
+   
+   error handling: exits if memory runs out
+----------------------------------------------------------------------------*/
+static double *plan_axis(int src, int dst, int align, int *pos, int *phase, int *phases) {
+   int64_t n, d, step, whole, part, a, b, r;
+   double *bank;
+   int i, p;
+
+   if (align == ALIGN_CORNER) {
+      // A single pixel samples the middle of the source
+      d = (dst > 1) ? dst - 1 : 2;
+      n = (dst > 1) ? 0 : src - 1;
+      step = (dst > 1) ? src - 1 : 0;
+   }
+   else {
+      d = 2 * (int64_t)dst;
+      n = (int64_t)src - dst;
+      step = 2 * (int64_t)src;
+   }
+
+   for (a = step, b = d; b; a = b, b = r) { r = a % b; }
+   *phases = (d / a < dst) ? (int)(d / a) : dst;
+
+   bank = (double *)malloc((size_t)*phases * CUBIC_TAPS * sizeof(double));
+   if (!bank) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   // Floor n / d once, then step the whole and fractional parts
+   whole = n / d;
+   r = n % d;
+   if (r < 0) {
+      r += d;
+      whole--;
+   }
+   for (i = 0, p = 0; i < dst; i++) {
+      pos[i] = (int)whole;
+      phase[i] = p;
+      if (i < *phases) {
+         cubic_weights((double)r / (double)d, bank + (size_t)i * CUBIC_TAPS);
+      }
+      if (++p == *phases) { p = 0; }
+
+      part = r + step % d;
+      whole += step / d + (part >= d);
+      r = (part >= d) ? part - d : part;
+   }
+   return(bank);
+}
+
+/*---------------------------------------------------------------------------
+   This function builds a resample plan, the source position of every
+   destination column and row, the polyphase weight banks and the tiling of
+   the destination.  The per pixel and tiled engines both take their
+   positions from the plan so they give the same pixels.
+
+   With an automatic tile size the tiles are made as large as possible while
+   the decoded source window and the horizontally filtered rows of one tile
+   still fit in half of the L2 cache.
+   
+         int src_x, int src_y          - Source image size
+         int dst_x, int dst_y          - Destination image size
+         int channels                  - Samples per pixel
+         const ResampleOptions *opts   - Resampling options, tile size
+   
+   returns: ResamplePlan *  Pointer to a malloced plan
+   
+   error handling: exits with an error code
+----------------------------------------------------------------------------*/
+static ResamplePlan *plan_resample(int src_x, int src_y, int dst_x, int dst_y, int channels,
+                                   const ResampleOptions *opts) {
+   ResamplePlan *plan;
+   long cache;
+   int i;
+
+   plan = (ResamplePlan *)calloc(1, sizeof(ResamplePlan));
+   if (!plan) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   plan->src_x = src_x;
+   plan->src_y = src_y;
+   plan->dst_x = dst_x;
+   plan->dst_y = dst_y;
+   plan->want_x = opts->tile_x;
+   plan->want_y = opts->tile_y;
+   plan->refs = -1;
+   plan->xint = (int *)malloc(dst_x * sizeof(int));
+   plan->yint = (int *)malloc(dst_y * sizeof(int));
+   plan->xphase = (int *)malloc(dst_x * sizeof(int));
+   plan->yphase = (int *)malloc(dst_y * sizeof(int));
+   if (!plan->xint || !plan->yint || !plan->xphase || !plan->yphase) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   plan->align = opts->align;
+   plan->xweight = plan_axis(src_x, dst_x, opts->align, plan->xint, plan->xphase, &plan->phases_x);
+   plan->yweight = plan_axis(src_y, dst_y, opts->align, plan->yint, plan->yphase, &plan->phases_y);
+   plan->xweight_f = (float *)malloc((size_t)plan->phases_x * CUBIC_TAPS * sizeof(float));
+   plan->yweight_f = (float *)malloc((size_t)plan->phases_y * CUBIC_TAPS * sizeof(float));
+   if (!plan->xweight_f || !plan->yweight_f) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   for (i = 0; i < plan->phases_x * CUBIC_TAPS; i++) { plan->xweight_f[i] = (float)plan->xweight[i]; }
+   for (i = 0; i < plan->phases_y * CUBIC_TAPS; i++) { plan->yweight_f[i] = (float)plan->yweight[i]; }
+
+   // The unsharp mask blur reaches three sigma past the tile
+   plan->amount = opts->amount;
+   plan->radius = opts->radius;
+   plan->threshold = opts->threshold;
+   if (opts->amount > 0.0) {
+      double sum = 0.0;
+
+      plan->halo = (int)ceil(3.0 * opts->radius);
+      plan->blur = (float *)malloc((2 * plan->halo + 1) * sizeof(float));
+      if (!plan->blur) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+      }
+      for (i = -plan->halo; i <= plan->halo; i++) {
+         sum += exp(-0.5 * i * i / (opts->radius * opts->radius));
+      }
+      for (i = -plan->halo; i <= plan->halo; i++) {
+         plan->blur[i + plan->halo] = (float)(exp(-0.5 * i * i / (opts->radius * opts->radius)) / sum);
+      }
+   }
+
+   plan->tile_x = opts->tile_x;
+   plan->tile_y = opts->tile_y;
+   if (plan->tile_x <= 0 || plan->tile_y <= 0) {
+      // Shrink square tiles until one tile's working set fits the cache
+      double step_x = (double)src_x / dst_x, step_y = (double)src_y / dst_y;
+      int size = MAX_TILE_SIZE, ext;
+
+      cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+      if (cache <= 0) { cache = DEFAULT_CACHE_SIZE; }
+
+      for (ext = size + 2 * plan->halo; size > MIN_TILE_SIZE && 
+           ((ext * step_y + 4) * (ext * step_x + 4) + (ext * step_y + 4) * ext)
+           * channels * sizeof(double) > cache / 2; ext = size + 2 * plan->halo) {
+         size /= 2;
+      }
+      plan->tile_x = plan->tile_y = size;
+   }
+   if (plan->tile_x > dst_x) { plan->tile_x = dst_x; }
+   if (plan->tile_y > dst_y) { plan->tile_y = dst_y; }
+   plan->tiles_x = (dst_x + plan->tile_x - 1) / plan->tile_x;
+   plan->tiles_y = (dst_y + plan->tile_y - 1) / plan->tile_y;
+
+   // The largest source window, halo included, decides the scratch buffer size
+   for (i = 0; i < plan->tiles_x; i++) {
+      int x0 = (i * plan->tile_x - plan->halo > 0) ? i * plan->tile_x - plan->halo : 0;
+      int x1 = ((i + 1) * plan->tile_x + plan->halo < dst_x) ? (i + 1) * plan->tile_x + plan->halo : dst_x;
+      int cols = plan->xint[x1 - 1] - plan->xint[x0] + 4;
+      if (cols > plan->window_x) { plan->window_x = cols; }
+   }
+   for (i = 0; i < plan->tiles_y; i++) {
+      int y0 = (i * plan->tile_y - plan->halo > 0) ? i * plan->tile_y - plan->halo : 0;
+      int y1 = ((i + 1) * plan->tile_y + plan->halo < dst_y) ? (i + 1) * plan->tile_y + plan->halo : dst_y;
+      int rows = plan->yint[y1 - 1] - plan->yint[y0] + 4;
+      if (rows > plan->window_y) { plan->window_y = rows; }
+   }
+   plan->channels = channels;
+
+   TRACE_PRINTF("plan tiles %dx%d of %dx%d window %dx%d phases %dx%d\n", plan->tiles_x, plan->tiles_y,
+                plan->tile_x, plan->tile_y, plan->window_x, plan->window_y, plan->phases_x, plan->phases_y);
+   return(plan);
+}
+
+static void free_plan(ResamplePlan *plan) {
+   if (plan) {
+      free(plan->xint);
+      free(plan->yint);
+      free(plan->xphase);
+      free(plan->yphase);
+      free(plan->xweight);
+      free(plan->yweight);
+      free(plan->xweight_f);
+      free(plan->yweight_f);
+      free(plan->blur);
+      free(plan);
+   }
+}
+
+/*---------------------------------------------------------------------------
+   These functions share plans between jobs of the same sizes.  With the
+   cache enabled a plan is kept after its last job and handed to the next
+   job with the same source, destination, channels, tile size, alignment and sharpening,
+   the least recently used idle plan is replaced when the cache is full.  Otherwise
+   every job builds and frees its own plan.  flush_plan_cache frees the kept
+   plans and turns the cache off.
+   
+         int src_x, src_y, dst_x, dst_y, channels - As for plan_resample
+         const ResampleOptions *opts   - Resampling options, tile size
+         ResamplePlan *plan            - Plan from acquire_plan to give back
+   
+   returns: acquire_plan  Pointer to a plan, give back with release_plan
+   
+   error handling: exits with an error code
+----------------------------------------------------------------------------*/
+static ResamplePlan *acquire_plan(int src_x, int src_y, int dst_x, int dst_y, int channels,
+                                  const ResampleOptions *opts) {
+   ResamplePlan *plan;
+   int i, slot = -1;
+
+   if (!plan_cache.enabled) {
+      return(plan_resample(src_x, src_y, dst_x, dst_y, channels, opts));
+   }
+
+   pthread_mutex_lock(&plan_cache.lock);
+   for (i = 0; i < PLAN_CACHE_SIZE; i++) {
+      plan = plan_cache.plan[i];
+      if (plan && plan->src_x == src_x && plan->src_y == src_y && plan->dst_x == dst_x &&
+          plan->dst_y == dst_y && plan->channels == channels &&
+          plan->want_x == opts->tile_x && plan->want_y == opts->tile_y && plan->align == opts->align &&
+          plan->amount == opts->amount && plan->radius == opts->radius && plan->threshold == opts->threshold) {
+         plan->refs++;
+         plan->used = ++plan_cache.clock;
+         pthread_mutex_unlock(&plan_cache.lock);
+         return(plan);
+      }
+      // Prefer an empty slot, then the oldest plan no job is using
+      if (!plan) {
+         if (slot < 0 || plan_cache.plan[slot]) { slot = i; }
+      }
+      else if (plan->refs == 0 && (slot < 0 || (plan_cache.plan[slot] && plan->used < plan_cache.plan[slot]->used))) {
+         slot = i;
+      }
+   }
+
+   plan = plan_resample(src_x, src_y, dst_x, dst_y, channels, opts);
+   if (slot >= 0) {
+      free_plan(plan_cache.plan[slot]);
+      plan_cache.plan[slot] = plan;
+      plan->refs = 1;
+      plan->used = ++plan_cache.clock;
+   }
+   pthread_mutex_unlock(&plan_cache.lock);
+   return(plan);
+}
+
+static void release_plan(ResamplePlan *plan) {
+   if (!plan || plan->refs < 0) {
+      free_plan(plan);
+      return;
+   }
+   pthread_mutex_lock(&plan_cache.lock);
+   plan->refs--;
+   pthread_mutex_unlock(&plan_cache.lock);
+}
+
+static void flush_plan_cache(void) {
+   int i;
+
+   pthread_mutex_lock(&plan_cache.lock);
+   for (i = 0; i < PLAN_CACHE_SIZE; i++) {
+      free_plan(plan_cache.plan[i]);
+      plan_cache.plan[i] = NULL;
+   }
+   plan_cache.enabled = 0;
+   pthread_mutex_unlock(&plan_cache.lock);
+}
+
+/*---------------------------------------------------------------------------
+   This function returns the destination pixels of one tile of a plan,
+   the last tile across and down is cut at the image edge
+   
+         const ResamplePlan *plan      - Plan with the tiling
+         int tile                      - Tile number, row major
+         ImageRect *rect               - Returned pixels of the tile
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static void tile_rect(const ResamplePlan *plan, int tile, ImageRect *rect) {
+   rect->x0 = (tile % plan->tiles_x) * plan->tile_x;
+   rect->y0 = (tile / plan->tiles_x) * plan->tile_y;
+   rect->x1 = (rect->x0 + plan->tile_x < plan->dst_x) ? rect->x0 + plan->tile_x : plan->dst_x;
+   rect->y1 = (rect->y0 + plan->tile_y < plan->dst_y) ? rect->y0 + plan->tile_y : plan->dst_y;
+}
+
+/*---------------------------------------------------------------------------
+   These functions size and allocate the per worker buffers for tiles of a
+   plan.  scratch_size fills in the sizes and returns their total, the
+   memory one worker needs.
+   
+         const ResamplePlan *plan      - Plan the tiles come from
+         TileScratch *scratch          - Buffers to size
+   
+   returns: init_tile_scratch  Pointer to malloced buffers
+            scratch_size       Bytes in all the buffers
+   
+   error handling: exits with an error code
+----------------------------------------------------------------------------*/
+static size_t scratch_size(const ResamplePlan *plan, TileScratch *scratch) {
+   scratch->window_size = (size_t)plan->window_x * plan->window_y * plan->channels * sizeof(double);
+   scratch->rows_size = (size_t)(plan->tile_x + 2 * plan->halo) * plan->window_y * plan->channels * sizeof(double);
+   scratch->line_size = (size_t)(plan->tile_x + 2 * plan->halo) * plan->channels * sizeof(float);
+   scratch->block_size = plan->halo ? (size_t)(plan->tile_x + 2 * plan->halo) * (plan->tile_y + 2 * plan->halo)
+                                      * plan->channels * sizeof(float) : 0;
+   scratch->blurred_size = plan->halo ? (size_t)plan->tile_x * (plan->tile_y + 2 * plan->halo)
+                                        * plan->channels * sizeof(float) : 0;
+   return(scratch->window_size + scratch->rows_size + scratch->line_size + scratch->block_size +
+          scratch->blurred_size);
+}
+
+static TileScratch *init_tile_scratch(const ResamplePlan *plan) {
+   TileScratch *scratch;
+
+   scratch = (TileScratch *)malloc(sizeof(TileScratch));
+   if (!scratch) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   scratch_size(plan, scratch);
+   scratch->window = (double *)pool_alloc(scratch->window_size);
+   scratch->rows = (double *)pool_alloc(scratch->rows_size);
+   scratch->line = (float *)pool_alloc(scratch->line_size);
+   scratch->block = plan->halo ? (float *)pool_alloc(scratch->block_size) : NULL;
+   scratch->blurred = plan->halo ? (float *)pool_alloc(scratch->blurred_size) : NULL;
+   return(scratch);
+}
+
+static void free_tile_scratch(TileScratch *scratch) {
+   if (scratch) {
+      pool_free(scratch->window, scratch->window_size);
+      pool_free(scratch->rows, scratch->rows_size);
+      pool_free(scratch->line, scratch->line_size);
+      pool_free(scratch->block, scratch->block_size);
+      pool_free(scratch->blurred, scratch->blurred_size);
+      free(scratch);
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This function resamples one destination tile.  The source window the tile
+   needs is decoded once into scratch, filtered horizontally into one row
+   per source row, then filtered vertically into the destination, so the
+   working set stays in cache however wide the image is.  The same cubic
+   as sample_bicubic is applied in the same order so the result is
+   identical.
+   
+         const ResamplePlan *plan      - Geometry and tiling
+         PPMImage *source_image        - Input image
+         PPMImage *destination_image   - Output image, already sized
+         const LinearTables *lin       - Tables for linear light resampling, or NULL
+         const ImageRect *rect         - Destination pixels to do, within one tile
+         TileScratch *scratch          - Buffers for this worker
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void resize_tile_n(const ResamplePlan *plan, PPMImage *source_image, 
+                                 PPMImage *destination_image, const LinearTables *lin, const ImageRect *rect,
+                                 TileScratch *scratch, int output, const int channels, const int wide) {
+   int x0 = rect->x0, y0 = rect->y0, x1 = rect->x1, y1 = rect->y1;
+   int cx0 = plan->xint[x0] - 1, cols = plan->xint[x1 - 1] + 3 - cx0;
+   int ry0 = plan->yint[y0] - 1, rows = plan->yint[y1 - 1] + 3 - ry0;
+   int tw = x1 - x0;
+   double maxval = source_image->maxval;
+   double value[MAX_CHANNELS];
+   uint16_t sample[MAX_CHANNELS];
+   int x, y, r, i;
+
+   // Decode the source window, edges clamped like get_pixel_clamped
+   for (r = 0; r < rows; r++) {
+      for (x = 0; x < cols; x++) {
+         get_pixel_clamped_n(source_image, cx0 + x, ry0 + r, 
+                             scratch->window + ((size_t)r * cols + x) * channels, lin, channels, wide);
+      }
+   }
+
+   // Horizontal pass, one filtered row per source row
+   for (r = 0; r < rows; r++) {
+      const double *in = scratch->window + (size_t)r * cols * channels;
+      double *out = scratch->rows + (size_t)r * tw * channels;
+
+      for (x = x0; x < x1; x++) {
+         const double *p = in + (plan->xint[x] - 1 - cx0) * channels;
+         const double *w = plan->xweight + (size_t)plan->xphase[x] * CUBIC_TAPS;
+         for (i = 0; i < channels; i++) {
+            out[(x - x0) * channels + i] = CUBIC_SUM(w, p[i], p[channels + i], p[2*channels + i],
+                                                     p[3*channels + i]);
+         }
+      }
+   }
+
+   // Vertical pass straight into the destination
+   for (y = y0; y < y1; y++) {
+      const double *col = scratch->rows + (size_t)(plan->yint[y] - 1 - ry0) * tw * channels;
+      size_t stride = (size_t)tw * channels;
+      const double *w = plan->yweight + (size_t)plan->yphase[y] * CUBIC_TAPS;
+      unsigned char *row = image_row(destination_image, y);
+
+      for (x = 0; x < tw; x++) {
+         for (i = 0; i < channels; i++) {
+            size_t k = (size_t)x * channels + i;
+            value[i] = CUBIC_SUM(w, col[k], col[stride + k], col[2*stride + k], col[3*stride + k]);
+         }
+         store_pixel_n(value, sample, maxval, lin, channels);
+         TRACE_PRINTF("src %d phase %d,%d phase %d\n", plan->xint[x0 + x], plan->xphase[x0 + x],
+                      plan->yint[y], plan->yphase[y]);
+         TRACE_SAMPLE(x0 + x, y, sample, channels);
+         put_pixel_n(row, x0 + x, sample, source_image->maxval, output, channels, wide);
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This function stores one row of float results of the float engine.
+   Opaque images that are not in linear light or converted are clamped and
+   stored in a plain loop, the same clamp and truncation as store_pixel_n,
+   other images go through store_pixel_n and put_pixel_n.
+   
+         const float *line             - Results, premultiplied with alpha
+         unsigned char *row            - Destination row
+         int x0                        - Destination pixel of the first result
+         int width                     - Pixels in the row
+         const LinearTables *lin       - Tables to encode color back to sRGB, or NULL
+         int maxval                    - Largest sample value
+         int output                    - OUTPUT_RGB, OUTPUT_GRAY or OUTPUT_CHROMA
+         const int channels            - Source samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void store_row_f(const float *line, unsigned char *row, int x0, int width, const LinearTables *lin,
+                               int maxval, int output, const int channels, const int wide) {
+   size_t n, count = (size_t)width * channels;
+   float top = (float)maxval;
+   double value[MAX_CHANNELS];
+   uint16_t sample[MAX_CHANNELS];
+   int x, i;
+
+   if (!lin && !HAS_ALPHA(channels) && output == OUTPUT_RGB) {
+      row += (size_t)x0 * channels << wide;
+      for (n = 0; n < count; n++) {
+         float v = line[n];
+
+         v = (v >= 0.0f) ? ((v > top) ? top : v) : 0.0f;
+         if (wide) { ((uint16_t *)row)[n] = (uint16_t)v; }
+         else      { row[n] = (uint8_t)v; }
+      }
+      return;
+   }
+
+   for (x = 0; x < width; x++) {
+      for (i = 0; i < channels; i++) { value[i] = line[(size_t)x * channels + i]; }
+      store_pixel_n(value, sample, maxval, lin, channels);
+      put_pixel_n(row, (size_t)x0 + x, sample, maxval, output, channels, wide);
+   }
+}
+
+#ifdef TRACE
+/*---------------------------------------------------------------------------
+  This function prints a row of the float engine for trace builds, the
+  source position and phases of each pixel and the samples store_row_f
+  stores for it
+  
+      const ResamplePlan *plan  - Geometry and phases
+      const float *line         - Resampled values of the row, from x0
+      int x0, x1                - Destination pixels, first and one past the last
+      int y                     - Destination row
+      const LinearTables *lin   - Tables for linear light resampling, or NULL
+      int maxval                - Largest sample
+      int channels              - Samples per pixel
+  
+  return: nothing
+  
+  Error handling: none
+----------------------------------------------------------------------------*/
+static void trace_row_f(const ResamplePlan *plan, const float *line, int x0, int x1, int y,
+                        const LinearTables *lin, int maxval, int channels) {
+   double value[MAX_CHANNELS];
+   uint16_t sample[MAX_CHANNELS];
+   int x, i;
+
+   for (x = x0; x < x1; x++) {
+      for (i = 0; i < channels; i++) { value[i] = line[(size_t)(x - x0) * channels + i]; }
+      store_pixel_n(value, sample, maxval, lin, channels);
+      printf("src %d phase %d,%d phase %d\n", plan->xint[x], plan->xphase[x], plan->yint[y], plan->yphase[y]);
+      trace_sample(x, y, sample, channels);
+   }
+}
+#endif
+
+/*---------------------------------------------------------------------------
+   This function resamples one destination tile like resize_tile_n but in
+   single precision, which doubles the SIMD width of every pass.  The
+   vertical pass sums a whole row of the tile before storing it so the sum
+   is one loop over contiguous samples with four weights.  Results are
+   within one step of the double engine.
+
+   With sharpening the plan's halo of destination pixels around the tile
+   is resampled too, then the unsharp mask blurs the block across and down
+   and adds amount times the difference from the blur to every color
+   sample that differs by at least the threshold, before the tile is
+   stored.  The output is sharpened while it is still in cache instead of
+   in a second pass over the image.  The block edges are clamped only at
+   the image edges, so every tile sees the same neighbours and the tiling
+   doesn't show.  Alpha is left as resampled.
+   
+         const ResamplePlan *plan      - Geometry, tiling, float weights and sharpening
+         PPMImage *source_image        - Input image
+         PPMImage *destination_image   - Output image, already sized
+         const LinearTables *lin       - Tables for linear light resampling, or NULL
+         const ImageRect *rect         - Destination pixels to do, within one tile
+         TileScratch *scratch          - Buffers for this worker
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void resize_tile_f_n(const ResamplePlan *plan, PPMImage *source_image,
+                                   PPMImage *destination_image, const LinearTables *lin, const ImageRect *rect,
+                                   TileScratch *scratch, int output, const int channels, const int wide) {
+   int x0 = rect->x0, y0 = rect->y0, x1 = rect->x1, y1 = rect->y1;
+   int halo = plan->halo;
+   int ex0 = (x0 - halo > 0) ? x0 - halo : 0, ex1 = (x1 + halo < plan->dst_x) ? x1 + halo : plan->dst_x;
+   int ey0 = (y0 - halo > 0) ? y0 - halo : 0, ey1 = (y1 + halo < plan->dst_y) ? y1 + halo : plan->dst_y;
+   int cx0 = plan->xint[ex0] - 1, cols = plan->xint[ex1 - 1] + 3 - cx0;
+   int ry0 = plan->yint[ey0] - 1, rows = plan->yint[ey1 - 1] + 3 - ry0;
+   size_t stride = (size_t)(ex1 - ex0) * channels, tstride = (size_t)(x1 - x0) * channels, n;
+   float *window = (float *)scratch->window, *filtered = (float *)scratch->rows;
+   float *line = scratch->line, maxval = (float)source_image->maxval;
+   int x, y, r, i, k;
+
+   // Decode the source window, edges clamped like get_pixel_clamped
+   for (r = 0; r < rows; r++) {
+      int sy = ry0 + r;
+      const unsigned char *row;
+      float *out = window + (size_t)r * cols * channels;
+
+      CLAMP(sy, 0, source_image->y - 1);
+      row = image_row(source_image, sy);
+      for (x = 0; x < cols; x++) {
+         int sx = cx0 + x;
+
+         CLAMP(sx, 0, source_image->x - 1);
+         for (i = 0; i < channels; i++) {
+            unsigned int s = wide ? ((const uint16_t *)row)[(size_t)sx*channels + i] : row[(size_t)sx*channels + i];
+
+            // Alpha is already linear
+            if (lin && !(HAS_ALPHA(channels) && i == channels - 1)) { out[x*channels + i] = (float)lin->to_linear[s]; }
+            else                                                     { out[x*channels + i] = (float)s; }
+         }
+         if (HAS_ALPHA(channels)) {
+            for (i = 0; i < channels - 1; i++) {
+               out[x*channels + i] = out[x*channels + i] * out[x*channels + channels - 1] / maxval;
+            }
+         }
+      }
+   }
+
+   // Horizontal pass, one filtered row per source row
+   for (r = 0; r < rows; r++) {
+      const float *in = window + (size_t)r * cols * channels;
+      float *out = filtered + (size_t)r * stride;
+
+      for (x = ex0; x < ex1; x++) {
+         const float *p = in + (plan->xint[x] - 1 - cx0) * channels;
+         const float *w = plan->xweight_f + (size_t)plan->xphase[x] * CUBIC_TAPS;
+         for (i = 0; i < channels; i++) {
+            out[(x - ex0) * channels + i] = CUBIC_SUM(w, p[i], p[channels + i], p[2*channels + i],
+                                                      p[3*channels + i]);
+         }
+      }
+   }
+
+   // Vertical pass, a row of sums then the stores, or into the block to sharpen
+   for (y = ey0; y < ey1; y++) {
+      const float *col = filtered + (size_t)(plan->yint[y] - 1 - ry0) * stride;
+      const float *w = plan->yweight_f + (size_t)plan->yphase[y] * CUBIC_TAPS;
+      float *sums = halo ? scratch->block + (size_t)(y - ey0) * stride : line;
+
+      for (n = 0; n < stride; n++) {
+         sums[n] = CUBIC_SUM(w, col[n], col[stride + n], col[2*stride + n], col[3*stride + n]);
+      }
+      if (!halo) {
+         TRACE_ROW_F(plan, line, x0, x1, y, lin, source_image->maxval, channels);
+         store_row_f(line, image_row(destination_image, y), x0, x1 - x0, lin, source_image->maxval,
+                     output, channels, wide);
+      }
+   }
+   if (!halo) { return; }
+
+   // Blur across, only the tile columns are needed.  The row is copied
+   // into line with the image edges repeated so each tap is a plain loop.
+   for (r = 0; r < ey1 - ey0; r++) {
+      const float *in = scratch->block + (size_t)r * stride;
+      float *out = scratch->blurred + (size_t)r * tstride;
+
+      for (x = x0 - halo; x < x1 + halo; x++) {
+         int sx = x;
+
+         CLAMP(sx, ex0, ex1 - 1);
+         for (i = 0; i < channels; i++) {
+            line[(size_t)(x - x0 + halo) * channels + i] = in[(size_t)(sx - ex0) * channels + i];
+         }
+      }
+      for (n = 0; n < tstride; n++) { out[n] = 0.0f; }
+      for (k = 0; k <= 2 * halo; k++) {
+         const float *p = line + (size_t)k * channels;
+         float w = plan->blur[k];
+
+         for (n = 0; n < tstride; n++) { out[n] += w * p[n]; }
+      }
+   }
+
+   // Blur down a row at a time and sharpen it against the block
+   for (y = y0; y < y1; y++) {
+      const float *orig = scratch->block + (size_t)(y - ey0) * stride + (size_t)(x0 - ex0) * channels;
+      float amount = (float)plan->amount, threshold = (float)plan->threshold;
+
+      for (n = 0; n < tstride; n++) { line[n] = 0.0f; }
+      for (k = -halo; k <= halo; k++) {
+         int sy = y + k;
+         const float *in;
+         float w = plan->blur[k + halo];
+
+         CLAMP(sy, ey0, ey1 - 1);
+         in = scratch->blurred + (size_t)(sy - ey0) * tstride;
+         for (n = 0; n < tstride; n++) { line[n] += w * in[n]; }
+      }
+      for (n = 0; n < tstride; n++) {
+         float d = orig[n] - line[n];
+
+         line[n] = (fabsf(d) >= threshold) ? orig[n] + amount * d : orig[n];
+      }
+      if (HAS_ALPHA(channels)) {
+         for (n = channels - 1; n < tstride; n += channels) { line[n] = orig[n]; }
+      }
+      TRACE_ROW_F(plan, line, x0, x1, y, lin, source_image->maxval, channels);
+      store_row_f(line, image_row(destination_image, y), x0, x1 - x0, lin, source_image->maxval,
+                  output, channels, wide);
+   }
+}
+
+void resize_tile(const ResamplePlan *plan, PPMImage *source_image, PPMImage *destination_image,
+                 const LinearTables *lin, const ImageRect *rect, TileScratch *scratch, int engine, int output) {
+   if (engine == ENGINE_FLOAT) {
+      DISPATCH_FORMAT(source_image, resize_tile_f_n, plan, source_image, destination_image, lin, rect, scratch,
+                      output);
+   }
+   else {
+      DISPATCH_FORMAT(source_image, resize_tile_n, plan, source_image, destination_image, lin, rect, scratch,
+                      output);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   This function makes the matrix of a warp.  The matrix takes the center
+   of destination pixel x, y to a source position in pixels from the
+   source's top left corner:
+
+      sx = m[0] * (x + 0.5) + m[1] * (y + 0.5) + m[2]
+      sy = m[3] * (x + 0.5) + m[4] * (y + 0.5) + m[5]
+
+   An affine warp gives the matrix as it is.  A rotation turns the image
+   counterclockwise about its center onto the center of the destination,
+   scaled by the destination size like a resample.
+   
+         const ResampleOptions *opts   - Warp options
+         const PPMImage *source_image  - Source, for its size
+         const PPMImage *destination_image - Destination, for its size
+         double m[]                    - Returned six matrix entries
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static void warp_matrix(const ResampleOptions *opts, const PPMImage *source_image,
+                        const PPMImage *destination_image, double m[]) {
+   double step_x = (double)source_image->x / destination_image->x;
+   double step_y = (double)source_image->y / destination_image->y;
+   double c = cos(opts->angle * M_PI / 180.0), s = sin(opts->angle * M_PI / 180.0);
+   double cx = destination_image->x / 2.0, cy = destination_image->y / 2.0;
+
+   if (opts->warp == WARP_AFFINE) {
+      memcpy(m, opts->affine, 6 * sizeof(double));
+      return;
+   }
+   m[0] = step_x * c;
+   m[1] = -step_x * s;
+   m[2] = source_image->x / 2.0 - m[0] * cx - m[1] * cy;
+   m[3] = step_y * s;
+   m[4] = step_y * c;
+   m[5] = source_image->y / 2.0 - m[3] * cx - m[4] * cy;
+}
+
+/*---------------------------------------------------------------------------
+   This function warps one destination pixel from a source position.  A
+   position inside the source is sampled by the cubic of sample_bicubic,
+   with the taps clamped only near the edges, one outside gets the fill,
+   which is clear for images with alpha.  The position is rounded to 1/WARP_SNAP
+   pixel first so whole pixel positions sample exactly.
+   
+         const ResampleJob *job        - Warp job, source, tables, fill and output
+         unsigned char *row            - Destination row
+         int x, y                      - Destination pixel
+         double sx, sy                 - Source position, pixels from the top left corner
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void warp_pixel_n(const ResampleJob *job, unsigned char *row, int x, int y, double sx, double sy,
+                                const int channels, const int wide) {
+   PPMImage *source_image = job->source_image;
+   double px, py, wx[CUBIC_TAPS], wy[CUBIC_TAPS];
+   uint16_t sample[MAX_CHANNELS];
+   int xint, yint, i;
+
+   if (!(sx >= 0.0 && sx <= source_image->x && sy >= 0.0 && sy <= source_image->y)) {
+      for (i = 0; i < channels; i++) {
+         sample[i] = (HAS_ALPHA(channels) && i == channels - 1) ? 0 : (uint16_t)job->fill;
+      }
+      TRACE_PRINTF("src %g,%g fill\n", sx, sy);
+      TRACE_SAMPLE(x, y, sample, channels);
+      put_pixel_n(row, x, sample, source_image->maxval, job->output, channels, wide);
+      return;
+   }
+
+   px = floor((sx - 0.5) * WARP_SNAP + 0.5) / WARP_SNAP;
+   py = floor((sy - 0.5) * WARP_SNAP + 0.5) / WARP_SNAP;
+   xint = (int)floor(px);
+   yint = (int)floor(py);
+   cubic_weights(px - xint, wx);
+   cubic_weights(py - yint, wy);
+   if (xint >= 1 && xint + 2 < source_image->x && yint >= 1 && yint + 2 < source_image->y) {
+      sample_inside_n(source_image, xint, wx, yint, wy, sample, job->lin, channels, wide);
+   }
+   else {
+      sample_bicubic_n(source_image, xint, wx, yint, wy, sample, job->lin, channels, wide);
+   }
+   TRACE_PRINTF("src %d phase %g,%d phase %g\n", xint, px - xint, yint, py - yint);
+   TRACE_SAMPLE(x, y, sample, channels);
+   put_pixel_n(row, x, sample, source_image->maxval, job->output, channels, wide);
+}
+
+/*---------------------------------------------------------------------------
+   This function narrows the span of a row of destination pixels whose
+   source position stays inside 0 to limit along one axis.  The position
+   is s0 at the first pixel and moves by step per pixel.  The span is
+   widened by a pixel each way, and the limits by 1/WARP_SNAP pixel, far
+   more than the rounding of a stepped position, warp_pixel_n checks those.
+   
+         double s0                     - Position at the first pixel
+         double step                   - Change per pixel
+         double limit                  - Source width or height
+         int width                     - Pixels in the row
+         int *lo, *hi                  - Span to narrow, first and one past the last pixel
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static void warp_span(double s0, double step, double limit, int width, int *lo, int *hi) {
+   double k0, k1, t;
+
+   if (step == 0.0) {
+      if (!(s0 >= 0.0 && s0 <= limit)) { *lo = *hi = 0; }
+      return;
+   }
+   k0 = (-1.0 / WARP_SNAP - s0) / step;
+   k1 = (limit + 1.0 / WARP_SNAP - s0) / step;
+   if (k0 > k1) {
+      t = k0;
+      k0 = k1;
+      k1 = t;
+   }
+   k0 = floor(k0) - 1.0;
+   k1 = ceil(k1) + 2.0;
+   if (k0 > *lo) { *lo = (k0 < width) ? (int)k0 : width; }
+   if (k1 < *hi) { *hi = (k1 > 0.0) ? (int)k1 : 0; }
+}
+
+/*---------------------------------------------------------------------------
+   These functions warp a destination image through an affine matrix.
+   Along a row the source position is computed from the matrix at every
+   WARP_RUN pixel of the destination and stepped by the matrix column
+   from there.  warp_run_n does a run of a row that way, from the computed
+   position before it, so the same pixel gets the same position, to the
+   bit, whichever run it is part of.  warp_tile_n does a rectangle of the
+   destination and fills the spans before and after the source without
+   sampling, so small rotations of large pages cost little more than their
+   inside pixels.  warp_image_n does every pixel, for --tile off, and is
+   the reference the tiles are checked against.
+   
+         const ResampleJob *job        - Warp job with its plan, matrix and images
+         unsigned char *row            - Destination row
+         int y                         - Destination row number
+         int x0, x1                    - Pixels of the run, first and one past the last
+         const ImageRect *rect         - Destination pixels to do
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void warp_run_n(const ResampleJob *job, unsigned char *row, int y, int x0, int x1,
+                              const int channels, const int wide) {
+   const double *m = job->affine;
+   double sx, sy;
+   int x = x0, xb, end;
+
+   while (x < x1) {
+      xb = x - x % WARP_RUN;
+      end = (xb + WARP_RUN < x1) ? xb + WARP_RUN : x1;
+      sx = m[0] * (xb + 0.5) + m[1] * (y + 0.5) + m[2];
+      sy = m[3] * (xb + 0.5) + m[4] * (y + 0.5) + m[5];
+
+      for (; xb < x; xb++) {
+         sx += m[0];
+         sy += m[3];
+      }
+      for (; x < end; x++) {
+         warp_pixel_n(job, row, x, y, sx, sy, channels, wide);
+         sx += m[0];
+         sy += m[3];
+      }
+   }
+}
+
+static inline void warp_tile_n(const ResampleJob *job, const ImageRect *rect, const int channels, const int wide) {
+   const double *m = job->affine;
+   int x0 = rect->x0, y0 = rect->y0, x1 = rect->x1, y1 = rect->y1;
+   int tw = x1 - x0, lo, hi, x, y;
+
+   for (y = y0; y < y1; y++) {
+      unsigned char *row = image_row(job->destination_image, y);
+      double sx = m[0] * (x0 + 0.5) + m[1] * (y + 0.5) + m[2];
+      double sy = m[3] * (x0 + 0.5) + m[4] * (y + 0.5) + m[5];
+
+      lo = 0;
+      hi = tw;
+      warp_span(sx, m[0], job->source_image->x, tw, &lo, &hi);
+      warp_span(sy, m[3], job->source_image->y, tw, &lo, &hi);
+      if (hi < lo) { hi = lo; }
+
+      // Outside on the left and right, the fill
+      for (x = 0; x < lo; x++) {
+         warp_pixel_n(job, row, x0 + x, y, -1.0, -1.0, channels, wide);
+      }
+      for (x = hi; x < tw; x++) {
+         warp_pixel_n(job, row, x0 + x, y, -1.0, -1.0, channels, wide);
+      }
+
+      warp_run_n(job, row, y, x0 + lo, x0 + hi, channels, wide);
+   }
+}
+
+static inline void warp_image_n(const ResampleJob *job, const ImageRect *rect, const int channels, const int wide) {
+   int y;
+
+   for (y = rect->y0; y < rect->y1; y++) {
+      warp_run_n(job, image_row(job->destination_image, y), y, rect->x0, rect->x1, channels, wide);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   These functions manage the tile deque of one worker.  New work is pushed
+   at the tail.  The owner takes tiles from the back of the oldest range
+   while idle workers steal the front half of it, so the oldest job finishes
+   first and concurrent requests are not starved by newer ones.  A task is
+   a range of tiles so a whole band is one entry and a thief can take half
+   of it.
+   
+      TaskDeque *deque     - Deque to use, its lock is taken here
+      TileTask task        - Range of tiles to add
+      ResampleJob **job    - Returned job of the tile taken
+      int *tile            - Returned tile number
+  
+   Returns: deque_take, deque_steal  1 if a tile was taken, else 0
+   
+   Error Handling:   exits if memory runs out
+----------------------------------------------------------------------------*/
+static void deque_push(TaskDeque *deque, TileTask task) {
+   pthread_mutex_lock(&deque->lock);
+   if (deque->tail == deque->size) {
+      // Reuse the space stolen from the head before growing
+      if (deque->head > 0) {
+         memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(TileTask));
+         deque->tail -= deque->head;
+         deque->head = 0;
+      }
+      else {
+         deque->size = deque->size ? deque->size * 2 : 16;
+         deque->tasks = (TileTask *)realloc(deque->tasks, deque->size * sizeof(TileTask));
+         if (!deque->tasks) {
+            fprintf(stderr, "Unable to allocate memory\n");
+            exit(1);
+         }
+      }
+   }
+   deque->tasks[deque->tail++] = task;
+   pthread_mutex_unlock(&deque->lock);
+}
+
+static int deque_take(TaskDeque *deque, ResampleJob **job, int *tile) {
+   int found = 0;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->tail > deque->head) {
+      TileTask *task = &deque->tasks[deque->head];
+
+      *job = task->job;
+      *tile = --task->end;
+      if (task->end == task->begin) { deque->head++; }
+      if (deque->tail == deque->head) { deque->head = deque->tail = 0; }
+      found = 1;
+   }
+   pthread_mutex_unlock(&deque->lock);
+   return(found);
+}
+
+static int deque_steal(TaskDeque *deque, TileTask *stolen) {
+   int found = 0;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->tail > deque->head) {
+      TileTask *task = &deque->tasks[deque->head];
+
+      // Take the first half of the oldest range, all of it if it is one tile
+      *stolen = *task;
+      stolen->end = task->begin + (task->end - task->begin + 1) / 2;
+      task->begin = stolen->end;
+      if (task->begin == task->end) { deque->head++; }
+      if (deque->tail == deque->head) { deque->head = deque->tail = 0; }
+      found = 1;
+   }
+   pthread_mutex_unlock(&deque->lock);
+   return(found);
+}
+
+/*---------------------------------------------------------------------------
+   These functions run one tile for a worker, run_tile also signals the
+   job when its last tile is done.  An update job does its rectangle of the
+   tile rather than all of it.  A warp job warps the tile, otherwise it is
+   resampled with scratch buffers made per worker on the first tile it runs
+   for a job.
+   
+      ResampleJob *job     - Job the tile belongs to
+      int tile             - Tile number, or rectangle number of an update
+      int worker           - Worker number
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void work_tile(ResampleJob *job, int tile, int worker) {
+   ImageRect rect;
+
+   if (job->rects) { rect = job->rects[tile]; }
+   else            { tile_rect(job->plan, tile, &rect); }
+
+   if (job->warp) {
+      DISPATCH_FORMAT(job->source_image, warp_tile_n, job, &rect);
+      return;
+   }
+   if (!job->scratch[worker]) {
+      job->scratch[worker] = init_tile_scratch(job->plan);
+   }
+   resize_tile(job->plan, job->source_image, job->destination_image, job->lin, &rect, job->scratch[worker],
+               job->engine, job->output);
+}
+
+static void run_tile(ResampleJob *job, int tile, int worker) {
+   work_tile(job, tile, worker);
+
+   if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+      pthread_mutex_lock(&job->lock);
+      job->finished = 1;
+      pthread_cond_signal(&job->done);
+      pthread_mutex_unlock(&job->lock);
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This is the worker thread.  It works through its own deque, then tries
+   to steal from every other worker in turn, and sleeps only when no tiles
+   are queued anywhere.
+   
+      void *arg   - Pointer to this worker's Worker entry
+  
+   Returns: NULL
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void *worker_thread(void *arg) {
+   Worker *self = (Worker *)arg;
+   Scheduler *sched = self->sched;
+   ResampleJob *job;
+   TileTask stolen;
+   int tile, i;
+
+   stats_open_counters();
+
+   for (;;) {
+      if (deque_take(&self->deque, &job, &tile)) {
+         atomic_fetch_sub(&sched->queued, 1);
+         run_tile(job, tile, self->id);
+         continue;
+      }
+
+      for (i = 1; i < sched->workers; i++) {
+         if (deque_steal(&sched->worker[(self->id + i) % sched->workers].deque, &stolen)) {
+            deque_push(&self->deque, stolen);
+            break;
+         }
+      }
+      if (i < sched->workers) { continue; }
+
+      pthread_mutex_lock(&sched->lock);
+      while (atomic_load(&sched->queued) == 0 && !sched->stop) {
+         pthread_cond_wait(&sched->wake, &sched->lock);
+      }
+      if (sched->stop) {
+         pthread_mutex_unlock(&sched->lock);
+         break;
+      }
+      pthread_mutex_unlock(&sched->lock);
+   }
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+   This function starts the worker threads
+   
+      int workers    - Number of worker threads
+  
+   Returns: Scheduler *  Pointer to a malloced, running scheduler
+   
+   Error Handling:   exits with an error code
+----------------------------------------------------------------------------*/
+static Scheduler *init_scheduler(int workers) {
+   Scheduler *sched;
+   int i;
+
+   sched = (Scheduler *)calloc(1, sizeof(Scheduler));
+   if (sched) { sched->worker = (Worker *)calloc(workers, sizeof(Worker)); }
+   if (!sched || !sched->worker) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   sched->workers = workers;
+   atomic_init(&sched->queued, 0);
+   pthread_mutex_init(&sched->lock, NULL);
+   pthread_cond_init(&sched->wake, NULL);
+
+   for (i = 0; i < workers; i++) {
+      sched->worker[i].id = i;
+      sched->worker[i].sched = sched;
+      pthread_mutex_init(&sched->worker[i].deque.lock, NULL);
+   }
+   for (i = 0; i < workers; i++) {
+      if (pthread_create(&sched->worker[i].thread, NULL, worker_thread, &sched->worker[i])) {
+         fprintf(stderr, "Unable to start worker threads\n");
+         exit(1);
+      }
+   }
+   return(sched);
+}
+
+static void free_scheduler(Scheduler *sched) {
+   int i;
+
+   if (!sched) { return; }
+   pthread_mutex_lock(&sched->lock);
+   sched->stop = 1;
+   pthread_cond_broadcast(&sched->wake);
+   pthread_mutex_unlock(&sched->lock);
+
+   for (i = 0; i < sched->workers; i++) {
+      pthread_join(sched->worker[i].thread, NULL);
+      pthread_mutex_destroy(&sched->worker[i].deque.lock);
+      free(sched->worker[i].deque.tasks);
+   }
+   pthread_mutex_destroy(&sched->lock);
+   pthread_cond_destroy(&sched->wake);
+   free(sched->worker);
+   free(sched);
+}
+
+/*---------------------------------------------------------------------------
+   This function queues every tile of a job.  The tiles are cut into one
+   contiguous band per worker, after that idle workers balance the load by
+   stealing, including across jobs submitted at the same time.
+   
+      Scheduler *sched     - Running scheduler
+      ResampleJob *job     - Job with its plan set
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void scheduler_submit(Scheduler *sched, ResampleJob *job) {
+   int tiles = job->tiles;
+   int i;
+
+   atomic_fetch_add(&sched->queued, tiles);
+   for (i = 0; i < sched->workers; i++) {
+      TileTask task;
+
+      task.job = job;
+      task.begin = (int)((long)tiles * i / sched->workers);
+      task.end = (int)((long)tiles * (i + 1) / sched->workers);
+      if (task.end > task.begin) {
+         deque_push(&sched->worker[i].deque, task);
+      }
+   }
+
+   pthread_mutex_lock(&sched->lock);
+   pthread_cond_broadcast(&sched->wake);
+   pthread_mutex_unlock(&sched->lock);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function finds the destination pixels that read one axis of a
+   changed source span.  Destination pixel i reads source pixels pos[i] - 1
+   to pos[i] + 2, clamped to the image, and pos only grows, so they are one
+   run of pixels and two binary searches find its ends.
+   
+         const int pos[]               - Source pixel at or before each destination pixel
+         int dst, src                  - Destination and source size on this axis
+         int lo, hi                    - Changed source pixels, hi is one past the last
+         int *first, *end              - Returned pixels, end one past the last, both 0 if none
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static void dirty_span(const int pos[], int dst, int src, int lo, int hi, int *first, int *end) {
+   int a = 0, b = dst, mid, t;
+
+   // The first pixel whose last tap reaches lo
+   while (a < b) {
+      mid = a + (b - a) / 2;
+      t = pos[mid] + 2;
+      CLAMP(t, 0, src - 1);
+      if (t >= lo) { b = mid; }
+      else         { a = mid + 1; }
+   }
+   *first = a;
+
+   // Then the first whose first tap is past the span
+   for (b = dst; a < b; ) {
+      mid = a + (b - a) / 2;
+      t = pos[mid] - 1;
+      CLAMP(t, 0, src - 1);
+      if (t >= hi) { b = mid; }
+      else         { a = mid + 1; }
+   }
+   *end = a;
+}
+
+/*---------------------------------------------------------------------------
+   This function finds the destination pixels of a warp that read a
+   changed source rectangle.  The taps of a warped pixel reach 2.5 source
+   pixels, so the rectangle grown by 2 pixels each way is taken back
+   through the inverse matrix and the bounding box of its corners, with a
+   pixel of slack for the rounding, is the answer.  A matrix without an
+   inverse gives the whole destination.
+   
+         const double m[]              - Warp matrix, see warp_matrix
+         const ImageRect *changed      - Changed source pixels, inside the source
+         int dst_x, dst_y              - Destination size
+         ImageRect *dirty              - Returned destination pixels
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static void warp_dirty(const double m[], const ImageRect *changed, int dst_x, int dst_y, ImageRect *dirty) {
+   double det = m[0] * m[4] - m[1] * m[3];
+   double lo_x = HUGE_VAL, hi_x = -HUGE_VAL, lo_y = HUGE_VAL, hi_y = -HUGE_VAL;
+   int k;
+
+   dirty->x0 = dirty->y0 = 0;
+   dirty->x1 = dst_x;
+   dirty->y1 = dst_y;
+   if (det == 0.0 || !isfinite(det)) { return; }
+
+   for (k = 0; k < 4; k++) {
+      double u = ((k & 1) ? changed->x1 + 2.0 : changed->x0 - 2.0) - m[2];
+      double v = ((k & 2) ? changed->y1 + 2.0 : changed->y0 - 2.0) - m[5];
+      double x = (m[4] * u - m[1] * v) / det, y = (m[0] * v - m[3] * u) / det;
+
+      lo_x = fmin(lo_x, x);
+      hi_x = fmax(hi_x, x);
+      lo_y = fmin(lo_y, y);
+      hi_y = fmax(hi_y, y);
+   }
+
+   // Those are pixel centers, x + 0.5
+   lo_x = floor(lo_x - 0.5) - 1.0;
+   hi_x = ceil(hi_x - 0.5) + 2.0;
+   lo_y = floor(lo_y - 0.5) - 1.0;
+   hi_y = ceil(hi_y - 0.5) + 2.0;
+   if (lo_x > 0.0) { dirty->x0 = (lo_x < dst_x) ? (int)lo_x : dst_x; }
+   if (hi_x < dst_x) { dirty->x1 = (hi_x > 0.0) ? (int)hi_x : 0; }
+   if (lo_y > 0.0) { dirty->y0 = (lo_y < dst_y) ? (int)lo_y : dst_y; }
+   if (hi_y < dst_y) { dirty->y1 = (hi_y > 0.0) ? (int)hi_y : 0; }
+}
+
+/*---------------------------------------------------------------------------
+   These functions make the destination rectangles of an update job.
+   dirty_rects takes changed source rectangles to the destination pixels
+   whose taps read them, grown by the sharpen halo.  tile_pieces cuts
+   destination rectangles at the tile edges and merges them per tile into
+   the box around them, so no pixel is done twice and each rectangle fits
+   the scratch buffers of a tile.
+   
+         ResampleJob *job              - Job with its plan and warp matrix, gets
+                                         rects, tiles and pixels
+         const ImageRect *changed      - Changed source rectangles
+         const ImageRect *dirty        - Destination rectangles to redo
+         int count                     - Entries in changed or dirty
+   
+   returns: nothing
+   
+   error handling: exits with an error code
+----------------------------------------------------------------------------*/
+static void tile_pieces(ResampleJob *job, const ImageRect *dirty, int count) {
+   const ResamplePlan *plan = job->plan;
+   int tiles = plan->tiles_x * plan->tiles_y;
+   ImageRect *box;
+   int i, n, tx, ty;
+
+   box = (ImageRect *)calloc(tiles, sizeof(ImageRect));
+   if (!box) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   for (i = 0; i < count; i++) {
+      ImageRect d = dirty[i];
+
+      CLAMP(d.x0, 0, plan->dst_x);
+      CLAMP(d.x1, 0, plan->dst_x);
+      CLAMP(d.y0, 0, plan->dst_y);
+      CLAMP(d.y1, 0, plan->dst_y);
+      if (d.x0 >= d.x1 || d.y0 >= d.y1) { continue; }
+
+      for (ty = d.y0 / plan->tile_y; ty <= (d.y1 - 1) / plan->tile_y; ty++) {
+         for (tx = d.x0 / plan->tile_x; tx <= (d.x1 - 1) / plan->tile_x; tx++) {
+            ImageRect *b = &box[ty * plan->tiles_x + tx], t;
+
+            tile_rect(plan, ty * plan->tiles_x + tx, &t);
+            if (d.x0 > t.x0) { t.x0 = d.x0; }
+            if (d.y0 > t.y0) { t.y0 = d.y0; }
+            if (d.x1 < t.x1) { t.x1 = d.x1; }
+            if (d.y1 < t.y1) { t.y1 = d.y1; }
+            if (b->x0 >= b->x1) {
+               *b = t;
+               continue;
+            }
+            if (t.x0 < b->x0) { b->x0 = t.x0; }
+            if (t.y0 < b->y0) { b->y0 = t.y0; }
+            if (t.x1 > b->x1) { b->x1 = t.x1; }
+            if (t.y1 > b->y1) { b->y1 = t.y1; }
+         }
+      }
+   }
+
+   // Keep the tiles with something to do, in tile order
+   for (i = 0, n = 0; i < tiles; i++) {
+      if (box[i].x0 < box[i].x1) {
+         box[n] = box[i];
+         job->pixels += (uint64_t)(box[n].x1 - box[n].x0) * (box[n].y1 - box[n].y0);
+         n++;
+      }
+   }
+   job->rects = box;
+   job->tiles = n;
+}
+
+static void dirty_rects(ResampleJob *job, const ImageRect *changed, int count) {
+   const ResamplePlan *plan = job->plan;
+   ImageRect *dirty;
+   int i, n = 0;
+
+   dirty = (ImageRect *)malloc((count ? count : 1) * sizeof(ImageRect));
+   if (!dirty) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   for (i = 0; i < count; i++) {
+      ImageRect c = changed[i], *d = &dirty[n];
+
+      CLAMP(c.x0, 0, plan->src_x);
+      CLAMP(c.x1, 0, plan->src_x);
+      CLAMP(c.y0, 0, plan->src_y);
+      CLAMP(c.y1, 0, plan->src_y);
+      if (c.x0 >= c.x1 || c.y0 >= c.y1) { continue; }
+
+      if (job->warp) {
+         warp_dirty(job->affine, &c, plan->dst_x, plan->dst_y, d);
+      }
+      else {
+         dirty_span(plan->xint, plan->dst_x, plan->src_x, c.x0, c.x1, &d->x0, &d->x1);
+         dirty_span(plan->yint, plan->dst_y, plan->src_y, c.y0, c.y1, &d->y0, &d->y1);
+         if (d->x0 >= d->x1 || d->y0 >= d->y1) { continue; }
+         d->x0 -= plan->halo;
+         d->y0 -= plan->halo;
+         d->x1 += plan->halo;
+         d->y1 += plan->halo;
+      }
+      n++;
+   }
+   tile_pieces(job, dirty, n);
+   free(dirty);
+}
+
+/*---------------------------------------------------------------------------
+   These functions start resizing an input image into a destination image
+   sized by init_destination_image.  With a worker pool running the tiles
+   are queued and this returns at once, so several images can be in
+   flight, otherwise the work is done here.  resample_finish must be called
+   to wait for and free the job.
+
+   update_start redoes only the destination pixels that read a changed
+   part of the source.  The destination must hold the result of the same
+   options on the source before the change, the other pixels are left as
+   they are, and the result is the same as resampling it all again.
+   start_job can also be given the destination pixels to do, for strips.
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - defined output images, already sized
+         const ResampleOptions *opts   - Resampling options, output picks the conversion
+         const ImageRect *changed      - Changed source rectangles, NULL for all of it
+         int count                     - Entries in changed
+         int dirty                     - Set when changed are destination pixels to do
+   
+   returns: ResampleJob *  Pointer to the malloced job
+   
+   error handling: exits with an error code
+----------------------------------------------------------------------------*/
+static ResampleJob *start_job(PPMImage *source_image, PPMImage *destination_image,
+                              const ResampleOptions *opts, const ImageRect *changed, int count, int dirty) {
+   ResampleJob *job;
+   int tile;
+
+   job = (ResampleJob *)calloc(1, sizeof(ResampleJob));
+   if (!job) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   job->source_image = source_image;
+   job->destination_image = destination_image;
+   job->engine = opts->engine;
+   job->output = opts->output;
+   job->warp = (opts->warp != WARP_NONE);
+   job->fill = (opts->fill < source_image->maxval) ? opts->fill : source_image->maxval;
+   if (job->warp) { warp_matrix(opts, source_image, destination_image, job->affine); }
+   stats_begin(&job->mark);
+
+   if (!quiet) {
+      printf("Source x-width=%d | y-width=%d\n",source_image->x, source_image->y);
+      printf("Dest   x-width=%d | y-width=%d\n",destination_image->x, destination_image->y);
+   }
+    
+   // The sRGB conversions are folded into the sample reads and writes
+   if (opts->linear) {
+      job->lin = init_linear_tables(source_image->maxval);
+   }
+
+   job->plan = acquire_plan(source_image->x, source_image->y, destination_image->x,
+                            destination_image->y, source_image->channels, opts);
+   if (changed && dirty) {
+      tile_pieces(job, changed, count);
+   }
+   else if (changed) {
+      dirty_rects(job, changed, count);
+   }
+   else {
+      job->tiles = job->plan->tiles_x * job->plan->tiles_y;
+      job->pixels = (uint64_t)destination_image->x * destination_image->y;
+   }
+
+   // Gray and 16 bit images get dedicated kernels
+   if (opts->tile_x < 0) {
+      ImageRect all = { 0, 0, destination_image->x, destination_image->y };
+
+      for (tile = 0; tile < (job->rects ? job->tiles : 1); tile++) {
+         const ImageRect *rect = job->rects ? &job->rects[tile] : &all;
+
+         if (job->warp) {
+            DISPATCH_FORMAT(source_image, warp_image_n, job, rect);
+         }
+         else {
+            DISPATCH_FORMAT(source_image, resize_image_n, job->plan, source_image, destination_image, job->lin,
+                            rect, job->output);
+         }
+      }
+      return(job);
+   }
+   if (job->tiles == 0) { return(job); }
+
+   job->workers = scheduler ? scheduler->workers : 1;
+   job->scratch = (TileScratch **)calloc(job->workers, sizeof(TileScratch *));
+   if (!job->scratch) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   if (scheduler) {
+      atomic_init(&job->remaining, job->tiles);
+      pthread_mutex_init(&job->lock, NULL);
+      pthread_cond_init(&job->done, NULL);
+      job->threaded = 1;
+      scheduler_submit(scheduler, job);
+   }
+   else {
+      for (tile = 0; tile < job->tiles; tile++) {
+         work_tile(job, tile, 0);
+      }
+   }
+   return(job);
+}
+
+ResampleJob *resample_start(PPMImage *source_image, PPMImage *destination_image,
+                            const ResampleOptions *opts) {
+   return(start_job(source_image, destination_image, opts, NULL, 0, 0));
+}
+
+ResampleJob *update_start(PPMImage *source_image, PPMImage *destination_image,
+                          const ResampleOptions *opts, const ImageRect *changed, int count) {
+   return(start_job(source_image, destination_image, opts, changed, count, 0));
+}
+
+/*---------------------------------------------------------------------------
+   This function waits for a job from resample_start and frees it
+   
+         ResampleJob *job              - Job to wait for
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+void resample_finish(ResampleJob *job) {
+   int i;
+
+   if (job->threaded) {
+      pthread_mutex_lock(&job->lock);
+      while (!job->finished) {
+         pthread_cond_wait(&job->done, &job->lock);
+      }
+      pthread_mutex_unlock(&job->lock);
+      pthread_mutex_destroy(&job->lock);
+      pthread_cond_destroy(&job->done);
+   }
+   stats_end(STAGE_RESAMPLE, &job->mark, 0, job->pixels);
+
+   for (i = 0; i < job->workers; i++) {
+      free_tile_scratch(job->scratch[i]);
+   }
+   free(job->scratch);
+   free(job->rects);
+   release_plan(job->plan);
+   free_linear_tables(job->lin);
+   free(job);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function resizes an input image to create a new destination image.
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - defined output images, already sized
+         const ResampleOptions *opts   - Resampling options
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+void resize_image(PPMImage *source_image, PPMImage *destination_image, const ResampleOptions *opts) {
+   resample_finish(resample_start(source_image, destination_image, opts));
+}
+
+/*---------------------------------------------------------------------------
+   This function redoes the pixels of a resized image that read changed
+   rectangles of its source, see update_start.
+   
+         PPMImage *source_image        - Changed input image
+         PPMImage *destination_image   - Output of the same options before the change
+         const ResampleOptions *opts   - Resampling options
+         const ImageRect *changed      - Changed source rectangles
+         int count                     - Entries in changed
+   
+   returns: nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+void resize_update(PPMImage *source_image, PPMImage *destination_image, const ResampleOptions *opts,
+                   const ImageRect *changed, int count) {
+   resample_finish(update_start(source_image, destination_image, opts, changed, count));
+}
+
+
+/*---------------------------------------------------------------------------
+   This function hashes bytes 8 at a time with a multiply and shift mix.
+   It is not cryptographic, only fast and well spread for cache keys.
+   
+      const void *buf   - Bytes to hash
+      size_t size       - Number of bytes
+      uint64_t h        - Starting value, chains hashes together
+  
+   Returns: uint64_t  The hash
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static uint64_t hash_bytes(const void *buf, size_t size, uint64_t h) {
+   const unsigned char *p = (const unsigned char *)buf;
+   uint64_t w;
+
+   h ^= size * 0x9E3779B97F4A7C15ULL;
+   for (; size >= 8; size -= 8, p += 8) {
+      memcpy(&w, p, 8);
+      h = (h ^ (w * 0xFF51AFD7ED558CCDULL)) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+   }
+   w = 0;
+   memcpy(&w, p, size);
+   h = (h ^ (w * 0xFF51AFD7ED558CCDULL)) * 0x9E3779B97F4A7C15ULL;
+   h ^= h >> 32;
+   return(h);
+}
+
+/*---------------------------------------------------------------------------
+   This function makes the output cache key of a resample, the hash of the
+   source raster and every parameter that changes the output.  The tile
+   size and thread count give the same bytes so they are left out.
+   
+      const PPMImage *source        - Source image
+      const char *factor            - Factor as given, a number or a quick kernel
+      double scale                  - Factor as a number
+      const ResampleOptions *opts   - Resampling options
+  
+   Returns: uint64_t  The key
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static uint64_t cache_key(const PPMImage *source, const char *factor, double scale,
+                          const ResampleOptions *opts) {
+   size_t row = (size_t)source->x * image_pixel_bytes(source);
+   char params[384];
+   uint64_t h = CACHE_VERSION;
+   int y;
+
+   for (y = 0; y < source->y; y++) {
+      h = hash_bytes(image_row(source, y), row, h);
+   }
+   if (is_quick(factor)) {
+      snprintf(params, sizeof(params), "%d %d %d %d %s", source->x, source->y,
+               source->channels, source->maxval, factor);
+   }
+   else {
+      snprintf(params, sizeof(params), "%d %d %d %d %.17g %d %d %d %.17g %.17g %.17g %d", source->x, source->y,
+               source->channels, source->maxval, scale, opts->linear, opts->align,
+               (opts->tile_x < 0) ? ENGINE_DOUBLE : opts->engine, opts->amount, opts->radius, opts->threshold,
+               opts->output);
+      // A warp replaces the resample, its engine is always double
+      if (opts->warp == WARP_AFFINE) {
+         snprintf(params, sizeof(params), "%d %d %d %d %.17g %d warp %.17g %.17g %.17g %.17g %.17g %.17g %d %d",
+                  source->x, source->y, source->channels, source->maxval, scale, opts->linear,
+                  opts->affine[0], opts->affine[1], opts->affine[2], opts->affine[3], opts->affine[4],
+                  opts->affine[5], opts->fill, opts->output);
+      }
+      else if (opts->warp == WARP_ROTATE) {
+         snprintf(params, sizeof(params), "%d %d %d %d %.17g %d rotate %.17g %d %d", source->x, source->y,
+                  source->channels, source->maxval, scale, opts->linear, opts->angle, opts->fill, opts->output);
+      }
+   }
+   return(hash_bytes(params, strlen(params), h));
+}
+
+/*---------------------------------------------------------------------------
+   These functions look up and add entries in the on-disk output cache.
+   Entries are binary PPM or PAM files named by their key.  A hit touches
+   the file so its time is the last use.  cache_evict scans the directory,
+   removes the least recently used entries until the cache is under its
+   size limit and sets the running total of entry bytes.  It runs once at
+   startup, after that adding an entry only adds its size to the total
+   and scans when the total goes over the limit.
+   
+      uint64_t key            - Key from cache_key
+      const PPMImage *expect  - Sizes the entry must have
+      const PPMImage *img     - Image to add
+  
+   Returns: cache_lookup  Pointer to the malloced cached image, NULL on a miss
+            cache_evict   nothing
+            cache_store   nothing
+   
+   Error Handling:   cache errors are treated as misses and are not fatal
+----------------------------------------------------------------------------*/
+static PPMImage *cache_lookup(uint64_t key, const PPMImage *expect) {
+   char path[CACHE_PATH_SIZE];
+   PPMSource src = { -1, NULL, 0 };
+   PPMImage *img = NULL;
+   const char *err;
+   struct stat st;
+
+   snprintf(path, sizeof(path), "%s/%016llx.ppm", output_cache.dir, (unsigned long long)key);
+   src.fd = open(path, O_RDONLY);
+   if (src.fd >= 0 && fstat(src.fd, &st) == 0) {
+      src.size = (uint64_t)st.st_size;
+      img = load_ppm(&src, &err);
+      if (img && (img->x != expect->x || img->y != expect->y || img->channels != expect->channels ||
+                  img->maxval != expect->maxval)) {
+         free_image(img);
+         img = NULL;
+      }
+      if (img) { futimens(src.fd, NULL); }
+   }
+   if (src.fd >= 0) { close(src.fd); }
+
+   atomic_fetch_add(img ? &output_cache.hits : &output_cache.misses, 1);
+   return(img);
+}
+
+static int compare_cache_entry(const void *a, const void *b) {
+   const CacheEntry *x = (const CacheEntry *)a, *y = (const CacheEntry *)b;
+   return((x->used > y->used) - (x->used < y->used));
+}
+
+static void cache_evict(void) {
+   char path[CACHE_PATH_SIZE];
+   CacheEntry *entry = NULL, *grown;
+   struct dirent *de;
+   struct stat st;
+   uint64_t total = 0;
+   size_t count = 0, size = 0, i;
+   DIR *dir;
+
+   pthread_mutex_lock(&output_cache.lock);
+   dir = opendir(output_cache.dir);
+   while (dir && (de = readdir(dir)) != NULL) {
+      // Only entries, 16 hex digits and .ppm, are counted or removed
+      if (strlen(de->d_name) != 20 || strspn(de->d_name, "0123456789abcdef") != 16 ||
+          strcmp(de->d_name + 16, ".ppm")) {
+         continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", output_cache.dir, de->d_name);
+      if (stat(path, &st)) { continue; }
+      if (count == size) {
+         size = size ? size * 2 : 64;
+         grown = (CacheEntry *)realloc(entry, size * sizeof(CacheEntry));
+         if (!grown) { break; }
+         entry = grown;
+      }
+      memcpy(entry[count].name, de->d_name, 21);
+      entry[count].size = (uint64_t)st.st_size;
+      entry[count].used = (double)st.st_mtim.tv_sec + st.st_mtim.tv_nsec * 1e-9;
+      total += entry[count].size;
+      count++;
+   }
+   if (dir) { closedir(dir); }
+
+   if (count) { qsort(entry, count, sizeof(CacheEntry), compare_cache_entry); }
+   for (i = 0; i < count && total > output_cache.limit; i++) {
+      snprintf(path, sizeof(path), "%s/%s", output_cache.dir, entry[i].name);
+      if (unlink(path) == 0) { output_cache.evictions++; }
+      total -= entry[i].size;
+   }
+   output_cache.total = total;
+   pthread_mutex_unlock(&output_cache.lock);
+   free(entry);
+}
+
+static void cache_store(uint64_t key, const PPMImage *img) {
+   char path[CACHE_PATH_SIZE], temp[CACHE_PATH_SIZE];
+   struct stat st;
+   FILE *fp;
+   int failed, over;
+
+   // Write under a private name and rename so readers never see half a file
+   snprintf(path, sizeof(path), "%s/%016llx.ppm", output_cache.dir, (unsigned long long)key);
+   snprintf(temp, sizeof(temp), "%s/.tmp-%ld-%u", output_cache.dir, (long)getpid(),
+            atomic_fetch_add(&output_cache.serial, 1));
+   fp = fopen(temp, "wb");
+   if (!fp) { return; }
+   write_ppm_stream(fp, (PPMImage *)img, 0);
+   failed = ferror(fp);
+   if (fclose(fp) || failed || stat(temp, &st) || rename(temp, path)) {
+      unlink(temp);
+      return;
+   }
+
+   // A store racing a scan may be counted twice, which only scans sooner
+   pthread_mutex_lock(&output_cache.lock);
+   output_cache.total += (uint64_t)st.st_size;
+   over = (output_cache.total > output_cache.limit);
+   pthread_mutex_unlock(&output_cache.lock);
+   if (over) { cache_evict(); }
+}
+
+/*---------------------------------------------------------------------------
+   This function resamples an image, through the output cache when one is
+   set up.  A hit loads the earlier output and skips the resample.
+   
+         PPMImage *source_image        - Input image
+         const char *factor            - Factor as given, a number or a quick kernel
+         double scale                  - Factor as a number
+         const ResampleOptions *opts   - Resampling options
+   
+   returns: PPMImage *  The malloced output image
+   
+   error handling: exits with an error code like the resamples
+----------------------------------------------------------------------------*/
+static PPMImage *resample_cached(PPMImage *source_image, const char *factor, double scale,
+                                 const ResampleOptions *opts) {
+   PPMImage *destination_image = NULL, *hit, expect;
+   uint64_t key = 0;
+
+   if (is_quick(factor)) {
+      expect = *source_image;
+      expect.x = factor_size(factor, scale, source_image->x);
+      expect.y = factor_size(factor, scale, source_image->y);
+   }
+   else {
+      destination_image = init_destination_image(source_image, scale, opts->output);
+      expect = *destination_image;
+   }
+   if (output_cache.dir) {
+      key = cache_key(source_image, factor, scale, opts);
+      hit = cache_lookup(key, &expect);
+      if (hit) {
+         free_image(destination_image);
+         return(hit);
+      }
+   }
+
+   if (strcmp(factor, "2x") == 0) {
+      destination_image = resize2(source_image);
+   }
+   else if (quick_up(factor)) {
+      destination_image = resize_up(source_image, quick_up(factor));
+   }
+   else {
+      resize_image(source_image, destination_image, opts);
+   }
+
+   if (output_cache.dir) { cache_store(key, destination_image); }
+   return(destination_image);
+}
+
+/*---------------------------------------------------------------------------
+   These functions resample and write an image in the output mode of the
+   options.  YCbCr 4:2:0 output is two resamples of the source, the luma
+   at the destination size and the Cb and Cr planes straight from the
+   source at half of it, so no RGB image is made for either.  It is
+   written as a raw planar file, the luma rows then the Cb rows then the
+   Cr rows, one byte per sample or two little endian bytes above maxval
+   255, the layout of yuv420p and yuv420p16le.  Other modes are written
+   as PPM files.
+   
+         PPMImage *source_image        - Input image
+         const char *factor            - Factor as given, a number or a quick kernel
+         double scale                  - Factor as a number
+         const ResampleOptions *opts   - Resampling options
+         PPMImage **chroma             - Returned Cb and Cr planes for YCbCr output, else NULL
+         const char *filename          - File to write
+         PPMImage *img                 - Image, or the luma plane with chroma
+         FILE *fp                      - Open raw output file
+         int plane                     - Channel of img written as a plane
+   
+   returns: resample_output  The malloced output image or luma plane
+            write_plane, write_output  nothing
+   
+   error handling: exits with an error code like the resamples and writePPM
+----------------------------------------------------------------------------*/
+static PPMImage *resample_output(PPMImage *source_image, const char *factor, double scale,
+                                 const ResampleOptions *opts, PPMImage **chroma) {
+   ResampleOptions plane = *opts;
+   PPMImage *luma;
+
+   *chroma = NULL;
+   if (opts->output != OUTPUT_YCBCR420) {
+      return(resample_cached(source_image, factor, scale, opts));
+   }
+   plane.output = OUTPUT_GRAY;
+   luma = resample_cached(source_image, factor, scale, &plane);
+   plane.output = OUTPUT_CHROMA;
+   *chroma = resample_cached(source_image, factor, scale, &plane);
+   return(luma);
+}
+
+static void write_plane(FILE *fp, const PPMImage *img, int plane) {
+   unsigned char buff[BUFFER_SAMPLES * 2];
+   size_t done, n, k;
+   int wide = image_wide(img), y;
+
+   for (y = 0; y < img->y; y++) {
+      const unsigned char *row = image_row(img, y);
+      for (done = 0; done < (size_t)img->x; done += n) {
+         n = ((size_t)img->x - done < BUFFER_SAMPLES) ? (size_t)img->x - done : BUFFER_SAMPLES;
+         for (k = 0; k < n; k++) {
+            size_t at = (done + k) * img->channels + plane;
+            if (wide) {
+               buff[2*k] = (uint8_t)((const uint16_t *)row)[at];
+               buff[2*k + 1] = (uint8_t)(((const uint16_t *)row)[at] >> 8);
+            }
+            else {
+               buff[k] = row[at];
+            }
+         }
+         fwrite(buff, (size_t)1 << wide, n, fp);
+      }
+   }
+}
+
+static void write_output(const char *filename, PPMImage *img, PPMImage *chroma) {
+   StageMark mark;
+   long bytes;
+   FILE *fp;
+
+   if (!chroma) {
+      writePPM(filename, img);
+      return;
+   }
+
+   stats_begin(&mark);
+   fp = fopen(filename, "wb");
+   if (!fp) {
+       fprintf(stderr, "Unable to open file '%s'\n", filename);
+       exit(1);
+   }
+   // The chroma image interleaves Cb and Cr, each is written as a plane
+   write_plane(fp, img, 0);
+   write_plane(fp, chroma, 0);
+   write_plane(fp, chroma, 1);
+   bytes = ftell(fp);
+   fclose(fp);
+   stats_end(STAGE_WRITE, &mark, (bytes > 0) ? (uint64_t)bytes : 0, 0);
+}
+
+/*---------------------------------------------------------------------------
+   This function parses a size in bytes with an optional K, M or G suffix
+   
+      const char *text  - Size text
+  
+   Returns: uint64_t  The size, 0 if it is not a size
+   
+   Error Handling:   returns 0
+----------------------------------------------------------------------------*/
+static uint64_t parse_size(const char *text) {
+   char *end;
+   double size = strtod(text, &end);
+
+   if (end == text || size <= 0.0) { return(0); }
+   switch (*end) {
+      case 'k': case 'K': size *= 1024.0; end++; break;
+      case 'm': case 'M': size *= 1024.0 * 1024.0; end++; break;
+      case 'g': case 'G': size *= 1024.0 * 1024.0 * 1024.0; end++; break;
+   }
+   return(*end ? 0 : (uint64_t)size);
+}
+
+static void print_cache_stats(void) {
+   if (output_cache.dir) {
+      printf("Cache hits %d misses %d evictions %d\n", atomic_load(&output_cache.hits),
+             atomic_load(&output_cache.misses), output_cache.evictions);
+   }
+}
+
+
+/*---------------------------------------------------------------------------
+   This function compares two images sample by sample for --compare
+   
+      const PPMImage *a, *b   - Images to compare
+      double *psnr            - Returned peak signal to noise ratio in dB,
+                                INFINITY when the images are identical
+      unsigned int *max_diff  - Returned largest sample difference
+  
+   Returns: int  0 if the images have the same size and format, else -1
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int compare_images(const PPMImage *a, const PPMImage *b, double *psnr, unsigned int *max_diff) {
+   size_t count = (size_t)a->x * a->channels, n;
+   double sum = 0.0;
+   int y;
+
+   *psnr = INFINITY;
+   *max_diff = 0;
+   if (a->x != b->x || a->y != b->y || a->channels != b->channels || a->maxval != b->maxval) {
+      return(-1);
+   }
+
+   for (y = 0; y < a->y; y++) {
+      const unsigned char *ra = image_row(a, y), *rb = image_row(b, y);
+
+      for (n = 0; n < count; n++) {
+         int va = image_wide(a) ? ((const uint16_t *)ra)[n] : ra[n];
+         int vb = image_wide(b) ? ((const uint16_t *)rb)[n] : rb[n];
+         unsigned int d = (unsigned int)abs(va - vb);
+
+         if (d > *max_diff) { *max_diff = d; }
+         sum += (double)d * d;
+      }
+   }
+   if (sum > 0.0) {
+      *psnr = 10.0 * log10((double)a->maxval * a->maxval / (sum / ((double)count * a->y)));
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function checks a resampled image against a golden image.  With no
+   PSNR limit the images must be identical, otherwise the PSNR must reach
+   the limit, so faster engines that round differently can be validated.
+   
+      const char *golden   - Expected image file
+      const char *test     - Image file to check
+      double min_psnr      - Smallest PSNR passed in dB, 0 for exact
+  
+   Returns: int  0 if the image passes, 1 if it does not
+   
+   Error Handling:   exits if a file can't be read
+----------------------------------------------------------------------------*/
+static int run_compare(const char *golden, const char *test, double min_psnr) {
+   PPMImage *a = readPPM(golden), *b = readPPM(test);
+   unsigned int max_diff;
+   double psnr;
+   int pass;
+
+   if (compare_images(a, b, &psnr, &max_diff)) {
+      printf("FAIL %s: %dx%d %d channels maxval %d, expected %dx%d %d channels maxval %d\n", test,
+             b->x, b->y, b->channels, b->maxval, a->x, a->y, a->channels, a->maxval);
+      pass = 0;
+   }
+   else if (isinf(psnr)) {
+      printf("PASS %s: identical\n", test);
+      pass = 1;
+   }
+   else {
+      pass = (min_psnr > 0.0 && psnr >= min_psnr);
+      printf("%s %s: PSNR %.2f dB, max difference %u\n", pass ? "PASS" : "FAIL", test, psnr, max_diff);
+   }
+
+   free_image(a);
+   free_image(b);
+   return(pass ? 0 : 1);
+}
+
+static int compare_time(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return((x > y) - (x < y));
+}
+
+/*---------------------------------------------------------------------------
+   This function checks one --bench throughput against a baseline file:
+   each line is a test key and its megapixels per second.  A key with no
+   line is recorded, a throughput slower than the baseline by more than
+   the tolerance fails the run.
+   
+      const char *baseline          - Baseline file
+      const char *key               - Test key
+      double mpix                   - Measured megapixels per second
+      double tolerance              - Slowdown allowed, in percent
+  
+   Returns: int  0 on success, 1 for a regression
+   
+   Error Handling:   exits if the baseline file can't be written
+----------------------------------------------------------------------------*/
+static int check_baseline(const char *baseline, const char *key, double mpix, double tolerance) {
+   char line[BATCH_LINE_SIZE];
+   double recorded = 0.0;
+   int found = 0;
+   char *space;
+   FILE *fp;
+
+   fp = fopen(baseline, "r");
+   while (fp && fgets(line, sizeof(line), fp)) {
+      line[strcspn(line, "\n")] = '\0';
+      space = strrchr(line, ' ');
+      if (space && (size_t)(space - line) == strlen(key) && strncmp(line, key, strlen(key)) == 0) {
+         recorded = atof(space + 1);
+         found = 1;
+      }
+   }
+   if (fp) { fclose(fp); }
+
+   if (!found) {
+      fp = fopen(baseline, "a");
+      if (!fp) {
+         fprintf(stderr, "Unable to open file '%s'\n", baseline);
+         exit(1);
+      }
+      fprintf(fp, "%s %.3f\n", key, mpix);
+      fclose(fp);
+      printf("baseline recorded: %s %.3f\n", key, mpix);
+   }
+   else if (mpix < recorded * (1.0 - tolerance / 100.0)) {
+      printf("REGRESSION %s: %.2f Mpixel/s, baseline %.2f, tolerance %g%%\n", key, mpix, recorded, tolerance);
+      return(1);
+   }
+   else {
+      printf("baseline ok: %.2f Mpixel/s, baseline %.2f\n", mpix, recorded);
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function times repeated resamples of one image for --bench, then
+   repeated reads of the image file so the parsers are timed on their own.
+   Both median throughputs are checked against the baseline file when one
+   is given, the read under the key "read" and the image name.
+   
+      PPMImage *source_image        - Image to resample
+      const char *factor            - Factor as given, a number or a quick kernel
+      double scale                  - Factor as a number
+      const ResampleOptions *opts   - Resampling options
+      int runs                      - Number of timed resamples and reads
+      const char *name              - Name of the image file
+      const char *baseline          - Baseline file, or NULL
+      double tolerance              - Slowdown allowed, in percent
+  
+   Returns: int  0 on success, 1 for a regression
+   
+   Error Handling:   exits if the baseline file can't be written
+----------------------------------------------------------------------------*/
+static int run_bench(PPMImage *source_image, const char *factor, double scale, const ResampleOptions *opts,
+                     int runs, const char *name, const char *baseline, double tolerance) {
+   char key[BATCH_LINE_SIZE];
+   struct timespec start, stop;
+   const char *cache_dir = output_cache.dir;
+   PPMImage *destination_image, *chroma_image, *read_image;
+   double *seconds, mpix = 0.0, read_mpix;
+   int i, status = 0;
+
+   seconds = (double *)malloc(runs * sizeof(double));
+   if (!seconds) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   // The cache would time disk reads, not the resample
+   output_cache.dir = NULL;
+   quiet = 1;
+   for (i = 0; i < runs; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      destination_image = resample_output(source_image, factor, scale, opts, &chroma_image);
+      clock_gettime(CLOCK_MONOTONIC, &stop);
+      seconds[i] = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+      mpix = (double)destination_image->x * destination_image->y / 1e6;
+      free_image(destination_image);
+      free_image(chroma_image);
+   }
+   output_cache.dir = cache_dir;
+   quiet = 0;
+
+   qsort(seconds, runs, sizeof(double), compare_time);
+   mpix /= seconds[runs / 2];
+   printf("bench %d runs  best %.3f ms  median %.3f ms  %.2f Mpixel/s\n", runs,
+          seconds[0] * 1e3, seconds[runs / 2] * 1e3, mpix);
+
+   // The file is in the page cache after the first read, so this is the parser
+   for (i = 0; i < runs; i++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      read_image = readPPM(name);
+      clock_gettime(CLOCK_MONOTONIC, &stop);
+      seconds[i] = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+      free_image(read_image);
+   }
+   qsort(seconds, runs, sizeof(double), compare_time);
+   read_mpix = (double)source_image->x * source_image->y / 1e6 / seconds[runs / 2];
+   printf("bench %d reads  best %.3f ms  median %.3f ms  %.2f Mpixel/s\n", runs,
+          seconds[0] * 1e3, seconds[runs / 2] * 1e3, read_mpix);
+   free(seconds);
+   if (!baseline) { return(0); }
+
+   // The key names everything that changes the speed, and the thread count
+   snprintf(key, sizeof(key), "%s %s linear=%d align=%d engine=%d sharpen=%g,%g,%g output=%d warp=%d,%g "
+            "tile=%dx%d threads=%d", factor, name, opts->linear, opts->align, opts->engine, opts->amount,
+            opts->radius, opts->threshold, opts->output, opts->warp,
+            (opts->warp == WARP_ROTATE) ? opts->angle : opts->affine[0], opts->tile_x, opts->tile_y,
+            scheduler ? scheduler->workers : 1);
+   status |= check_baseline(baseline, key, mpix, tolerance);
+
+   // Reading doesn't depend on the options
+   snprintf(key, sizeof(key), "read %s", name);
+   status |= check_baseline(baseline, key, read_mpix, tolerance);
+   return(status);
+}
+
+/*---------------------------------------------------------------------------
+   This function mixes a pixel position into a well spread 64 bit value, so
+   the noise and text patterns are the same on every run and machine
+   
+      uint64_t x, y  - Position
+  
+   Returns: uint64_t  The mixed value
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static inline uint64_t mix_position(uint64_t x, uint64_t y) {
+   uint64_t z = x * 0x9e3779b97f4a7c15ULL + y * 0xc2b2ae3d27d4eb4fULL;
+
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return(z ^ (z >> 31));
+}
+
+/*---------------------------------------------------------------------------
+   This function fills one row of a synthetic image
+   
+      unsigned char *row   - Row of width * channels samples
+      int pattern          - GENERATE_* pattern
+      uint64_t y           - Row number
+      uint64_t width       - Image width
+      uint64_t height      - Image height
+      int channels         - 1 for gray, 3 for RGB
+  
+   Returns: nothing
+   
+   Error Handling:   none
+----------------------------------------------------------------------------*/
+static void generate_row(unsigned char *row, int pattern, uint64_t y, uint64_t width, uint64_t height,
+                         int channels) {
+   uint64_t x, bits = 0;
+   int c;
+
+   for (x = 0; x < width; x++) {
+      unsigned char value[3];
+
+      switch (pattern) {
+         case GENERATE_GRADIENT:
+            value[0] = (unsigned char)(width > 1 ? x * 255 / (width - 1) : 0);
+            value[1] = (unsigned char)(height > 1 ? y * 255 / (height - 1) : 0);
+            value[2] = (unsigned char)(width + height > 2 ? (x + y) * 255 / (width + height - 2) : 0);
+            break;
+         case GENERATE_NOISE:
+            if (x % 2 == 0) { bits = mix_position(x, y); }
+            value[0] = (unsigned char)(bits >> (x % 2 * 32));
+            value[1] = (unsigned char)(bits >> (x % 2 * 32 + 8));
+            value[2] = (unsigned char)(bits >> (x % 2 * 32 + 16));
+            break;
+         case GENERATE_CHECKER:
+            value[0] = ((x / GENERATE_SQUARE + y / GENERATE_SQUARE) & 1) ? 255 : 0;
+            value[1] = ((x / GENERATE_SQUARE + y / GENERATE_SQUARE) & 1) ? 224 : 32;
+            value[2] = ((x / GENERATE_SQUARE + y / GENERATE_SQUARE) & 1) ? 192 : 64;
+            break;
+         default: {
+            // Dark 5x7 glyphs in 8x12 cells, every fourth line of cells is blank
+            uint64_t gx = x % 8, gy = y % 12;
+            int ink = 0;
+
+            if (gx >= 1 && gx <= 5 && gy >= 3 && gy <= 9 && (y / 12) % 4 != 3) {
+               ink = (mix_position(x / 8, y / 12) >> ((gy - 3) * 5 + gx - 1)) & 1;
+            }
+            value[0] = value[1] = value[2] = ink ? 16 : 240;
+            break;
+         }
+      }
+
+      if (channels == 1) {
+         // The gray samples are the mean so each pattern keeps its edges
+         row[x] = (unsigned char)((value[0] + value[1] + value[2]) / 3);
+      }
+      else {
+         for (c = 0; c < 3; c++) { row[x*3 + c] = value[c]; }
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This function writes a deterministic synthetic P5 or P6 image for
+   benchmarks.  Rows are generated and written one at a time so images far
+   larger than memory can be made.
+   
+      const char *pattern  - gradient, noise, checker or text
+      const char *size     - WxH
+      int channels         - 1 for P5, 3 for P6
+      const char *filename - Output file
+  
+   Returns: int  0 on success, 99 for bad arguments
+   
+   Error Handling:   exits on file errors
+----------------------------------------------------------------------------*/
+static int run_generate(const char *pattern, const char *size, int channels, const char *filename) {
+   static const char *names[] = { "gradient", "noise", "checker", "text" };
+   unsigned long long width, height;
+   unsigned char *row;
+   uint64_t y;
+   int kind;
+   char end;
+   FILE *fp;
+
+   for (kind = 0; kind < 4 && strcmp(pattern, names[kind]); kind++);
+   if (kind == 4) {
+      printf("error pattern must be gradient, noise, checker or text\n");
+      return(99);
+   }
+   if (sscanf(size, "%llux%llu%c", &width, &height, &end) != 2 || width < 1 || height < 1 ||
+       width > PPM_MAX_DIMENSION || height > PPM_MAX_DIMENSION) {
+      printf("error size must be WxH up to %ld on a side\n", PPM_MAX_DIMENSION);
+      return(99);
+   }
+   if (channels != 1 && channels != 3) {
+      printf("error channels must be 1 or 3\n");
+      return(99);
+   }
+
+   row = (unsigned char *)malloc(width * channels);
+   fp = fopen(filename, "wb");
+   if (!row || !fp) {
+      fprintf(stderr, "Unable to open file '%s'\n", filename);
+      exit(1);
+   }
+
+   fprintf(fp, "P%c\n%llu %llu\n255\n", channels == 1 ? '5' : '6', width, height);
+   for (y = 0; y < height; y++) {
+      generate_row(row, kind, y, width, height, channels);
+      if (fwrite(row, channels, width, fp) != width) {
+         fprintf(stderr, "Error writing file '%s'\n", filename);
+         exit(1);
+      }
+   }
+   if (fclose(fp)) {
+      fprintf(stderr, "Error writing file '%s'\n", filename);
+      exit(1);
+   }
+
+   printf("Wrote %llux%llu %s %s\n", width, height, pattern, filename);
+   free(row);
+   return(0);
+}
+
+
+/*---------------------------------------------------------------------------
+   This function compares a source frame with the one before it in
+   FRAME_BLOCK square blocks and returns the blocks that differ, with runs
+   of changed blocks along a block row joined into one rectangle.  Whole
+   rows are compared first and a block is only compared until it is found
+   to differ, so a static frame costs one memcmp pass over both images.
+   
+         const PPMImage *previous      - Source of the frame before, same size and format
+         const PPMImage *source_image  - Source of this frame
+         ImageRect **changed           - Returned malloced changed rectangles
+         int *blocks                   - Returned number of changed blocks
+   
+   returns: int  Number of rectangles
+   
+   error handling: exits if memory runs out
+----------------------------------------------------------------------------*/
+static int frame_changes(const PPMImage *previous, const PPMImage *source_image, ImageRect **changed,
+                         int *blocks) {
+   int bx = (source_image->x + FRAME_BLOCK - 1) / FRAME_BLOCK, by = (source_image->y + FRAME_BLOCK - 1) / FRAME_BLOCK;
+   size_t pixel = image_pixel_bytes(source_image), row = (size_t)source_image->x * pixel;
+   unsigned char *diff;
+   int n = 0, i, j, y, y1;
+
+   diff = (unsigned char *)malloc(bx);
+   *changed = (ImageRect *)malloc((size_t)bx * by * sizeof(ImageRect));
+   if (!diff || !*changed) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   *blocks = 0;
+   for (j = 0; j < by; j++) {
+      y1 = ((j + 1) * FRAME_BLOCK < source_image->y) ? (j + 1) * FRAME_BLOCK : source_image->y;
+      memset(diff, 0, bx);
+      for (y = j * FRAME_BLOCK; y < y1; y++) {
+         const unsigned char *a = image_row(previous, y), *b = image_row(source_image, y);
+
+         if (memcmp(a, b, row) == 0) { continue; }
+         for (i = 0; i < bx; i++) {
+            size_t x0 = (size_t)i * FRAME_BLOCK * pixel, size = FRAME_BLOCK * pixel;
+
+            if (x0 + size > row) { size = row - x0; }
+            if (!diff[i] && memcmp(a + x0, b + x0, size)) { diff[i] = 1; }
+         }
+      }
+
+      for (i = 0; i < bx; ) {
+         if (!diff[i]) {
+            i++;
+            continue;
+         }
+         (*changed)[n].x0 = i * FRAME_BLOCK;
+         (*changed)[n].y0 = j * FRAME_BLOCK;
+         for (; i < bx && diff[i]; i++) { (*blocks)++; }
+         (*changed)[n].x1 = (i * FRAME_BLOCK < source_image->x) ? i * FRAME_BLOCK : source_image->x;
+         (*changed)[n].y1 = y1;
+         n++;
+      }
+   }
+   free(diff);
+   return(n);
+}
+
+/*---------------------------------------------------------------------------
+   This function resamples every image listed in a batch file.  Each line is
+   "factor infile outfile" like the command line, blank lines and lines
+   starting with '#' are skipped.  Up to BATCH_IN_FLIGHT images are queued on
+   the worker pool at once so small and large images share the workers.
+
+   Lines are often the frames of a video or screen capture.  An image the
+   size and format of the one on the line before, with the same factor,
+   is compared with it by frame_changes.  When at most half of its blocks
+   changed, the output before is finished, copied, and only the pixels that
+   read a changed block are resampled again, see update_start.  The output
+   is the same as resampling the whole frame.  Other images are queued
+   without waiting, so unrelated images of one size still run side by side.
+
+   batch_start sizes one output plane and queues its resample or update,
+   or takes it from the cache.
+   
+         const char *filename          - Batch file name
+         const ResampleOptions *opts   - Resampling options
+         PPMImage *source_image        - Input image
+         double scale                  - Factor as a number
+         const char *factor            - Factor as given
+         const PPMImage *previous      - Finished output plane of the frame before, or NULL
+         const ImageRect *changed      - Source rectangles changed since that frame
+         int count                     - Entries in changed
+         PPMImage **destination        - Returned output plane
+         uint64_t *key                 - Returned cache key
+   
+   returns: run_batch    0 on success, 99 for a bad line, the lines before it
+                         are still finished and written
+            batch_start  The queued job, NULL for a cache hit or an unchanged frame
+   
+   error handling: exits on file errors like the single image path
+----------------------------------------------------------------------------*/
+static ResampleJob *batch_start(PPMImage *source_image, const char *factor, double scale,
+                                const ResampleOptions *opts, const PPMImage *previous,
+                                const ImageRect *changed, int count, PPMImage **destination, uint64_t *key) {
+   PPMImage *hit = NULL;
+
+   *destination = init_destination_image(source_image, scale, opts->output);
+   if (output_cache.dir) {
+      *key = cache_key(source_image, factor, scale, opts);
+      hit = cache_lookup(*key, *destination);
+   }
+   if (hit) {
+      free_image(*destination);
+      *destination = hit;
+      return(NULL);
+   }
+   if (previous) {
+      copy_image_rows(*destination, previous);
+      return(count ? update_start(source_image, *destination, opts, changed, count) : NULL);
+   }
+   return(resample_start(source_image, *destination, opts));
+}
+
+static int run_batch(const char *filename, const ResampleOptions *opts) {
+   char line[BATCH_LINE_SIZE], factor[BATCH_LINE_SIZE], infile[BATCH_LINE_SIZE], outfile[BATCH_LINE_SIZE];
+   char last[BATCH_LINE_SIZE] = "";
+   ResampleOptions plane = *opts;
+   ResampleJob *job[BATCH_IN_FLIGHT], *chroma_job[BATCH_IN_FLIGHT];
+   PPMImage *source[BATCH_IN_FLIGHT], *destination[BATCH_IN_FLIGHT], *chroma[BATCH_IN_FLIGHT];
+   uint64_t key[BATCH_IN_FLIGHT], chroma_key[BATCH_IN_FLIGHT];
+   char *output[BATCH_IN_FLIGHT];
+   ImageRect *changed = NULL;
+   int count = 0, first = 0, status = 0, i, p, changes, blocks;
+   FILE *fp;
+
+   fp = fopen(filename, "r");
+   if (!fp) {
+      fprintf(stderr, "Unable to open file '%s'\n", filename);
+      exit(1);
+   }
+
+   for (;;) {
+      double scale = 0.0;
+      // An error stops the reading, the images already queued are still finished
+      int more = !status && (fgets(line, sizeof(line), fp) != NULL);
+
+      if (more) {
+         if (sscanf(line, "%s", factor) != 1 || factor[0] == '#') { continue; }
+         if (sscanf(line, "%s %s %s", factor, infile, outfile) != 3) {
+            printf("error bad batch line: %s", line);
+            status = 99;
+            continue;
+         }
+         scale = atof(factor);
+         if (!is_quick(factor) && (scale <= 0.0)) { printf("error scale must be positive\n"); status = 99; continue; }
+         if (option_conflict(factor, opts)) { printf("error %s\n", option_conflict(factor, opts)); status = 99; continue; }
+      }
+
+      // Write out the oldest image when the window is full or at the end
+      while (count > 0 && (count == BATCH_IN_FLIGHT || !more)) {
+         if (job[first]) { resample_finish(job[first]); }
+         if (job[first] && output_cache.dir) { cache_store(key[first], destination[first]); }
+         if (chroma_job[first]) { resample_finish(chroma_job[first]); }
+         if (chroma_job[first] && output_cache.dir) { cache_store(chroma_key[first], chroma[first]); }
+         write_output(output[first], destination[first], chroma[first]);
+         free_image(source[first]);
+         free_image(destination[first]);
+         free_image(chroma[first]);
+         free(output[first]);
+         first = (first + 1) % BATCH_IN_FLIGHT;
+         count--;
+      }
+      if (!more) { break; }
+      
+      i = (first + count) % BATCH_IN_FLIGHT;
+      remove(outfile);
+      source[i] = readPPM(infile);
+      if (!output_fits(factor, scale, source[i])) {
+         printf("error %s scaled by %s is out of range\n", infile, factor);
+         free_image(source[i]);
+         status = 99;
+         continue;
+      }
+      output[i] = strdup(outfile);
+
+      // A frame mostly like the one before waits for it and redoes the changes
+      p = (first + count - 1) % BATCH_IN_FLIGHT;
+      changes = -1;
+      if (count > 0 && !is_quick(factor) && strcmp(factor, last) == 0 && source[p]->x == source[i]->x &&
+          source[p]->y == source[i]->y && source[p]->channels == source[i]->channels &&
+          source[p]->maxval == source[i]->maxval) {
+         int total = ((source[i]->x + FRAME_BLOCK - 1) / FRAME_BLOCK) * ((source[i]->y + FRAME_BLOCK - 1) / FRAME_BLOCK);
+
+         changes = frame_changes(source[p], source[i], &changed, &blocks);
+         if (blocks > total / 2) {
+            changes = -1;
+         }
+         else {
+            if (!quiet) { printf("Frame %s changed %d of %d blocks\n", infile, blocks, total); }
+            if (job[p]) { resample_finish(job[p]); }
+            if (job[p] && output_cache.dir) { cache_store(key[p], destination[p]); }
+            if (chroma_job[p]) { resample_finish(chroma_job[p]); }
+            if (chroma_job[p] && output_cache.dir) { cache_store(chroma_key[p], chroma[p]); }
+            job[p] = chroma_job[p] = NULL;
+         }
+      }
+      strcpy(last, factor);
+
+      // Cache hits, unchanged frames and the quick kernels are done here,
+      // resamples are queued, YCbCr output queues the luma and the chroma planes
+      job[i] = chroma_job[i] = NULL;
+      chroma[i] = NULL;
+      if (is_quick(factor)) {
+         destination[i] = resample_cached(source[i], factor, scale, opts);
+      }
+      else if (opts->output == OUTPUT_YCBCR420) {
+         plane.output = OUTPUT_GRAY;
+         job[i] = batch_start(source[i], factor, scale, &plane, (changes >= 0) ? destination[p] : NULL,
+                              changed, changes, &destination[i], &key[i]);
+         plane.output = OUTPUT_CHROMA;
+         chroma_job[i] = batch_start(source[i], factor, scale, &plane, (changes >= 0) ? chroma[p] : NULL,
+                                     changed, changes, &chroma[i], &chroma_key[i]);
+      }
+      else {
+         job[i] = batch_start(source[i], factor, scale, opts, (changes >= 0) ? destination[p] : NULL,
+                              changed, changes, &destination[i], &key[i]);
+      }
+      free(changed);
+      changed = NULL;
+      count++;
+   }
+   fclose(fp);
+   return(status);
+}
+
+/*---------------------------------------------------------------------------
+   This function updates a previous output for changed parts of its
+   source.  The previous output must have been made from the source before
+   the change with the same options, its pixels that read a changed
+   rectangle are resampled again and the rest are kept.  The output cache
+   is not used.
+   
+         PPMImage *source_image        - Changed input image
+         double scale                  - Factor the previous output was made with
+         const ResampleOptions *opts   - Options it was made with
+         const char *previous          - Previous output file
+         const ImageRect *changed      - Changed source rectangles
+         int count                     - Entries in changed
+         const char *filename          - Updated output file, can be previous
+   
+   returns: int  0 on success, 99 if previous doesn't fit the source and options
+   
+   error handling: exits on file errors like the single image path
+----------------------------------------------------------------------------*/
+static int run_update(PPMImage *source_image, double scale, const ResampleOptions *opts, const char *previous,
+                      const ImageRect *changed, int count, const char *filename) {
+   PPMImage *destination_image = readPPM(previous);
+   PPMImage *expect = init_destination_image(source_image, scale, opts->output);
+   int fits = (destination_image->x == expect->x && destination_image->y == expect->y &&
+               destination_image->channels == expect->channels && destination_image->maxval == expect->maxval);
+
+   if (!fits) {
+      printf("error %s is %dx%d with %d channels, the update needs %dx%d with %d\n", previous,
+             destination_image->x, destination_image->y, destination_image->channels, expect->x, expect->y,
+             expect->channels);
+   }
+   else {
+      printf("Updating %d changed rectangles of %s\n", count, previous);
+      resize_update(source_image, destination_image, opts, changed, count);
+      writePPM(filename, destination_image);
+   }
+   free_image(expect);
+   free_image(destination_image);
+   return(fits ? 0 : 99);
+}
+
+/*---------------------------------------------------------------------------
+   These functions resample an image too large for memory in strips of
+   output rows.  A band of output rows needs the source rows its taps read
+   around it and its sharpen halo, and each band is made as tall as fits in
+   the limit beside the plan and the scratch buffers of the workers.  The
+   source rows are read with pread as the bands move down the image, rows
+   the band before already holds are moved rather than read again, and each
+   band of output is written at its offset in the output file with pwrite,
+   so both files are gone through once in order.  The output is the same
+   as resampling the whole image.
+   
+         const ResamplePlan *plan      - Plan of the whole image
+         const double *m               - Warp matrix, NULL for a resample
+         int d0, d1                    - Output rows of the band
+         int *r0, *r1                  - Returned source rows the band reads
+         size_t src_row, dst_row       - Bytes of a source and an output row in memory
+         uint64_t room                 - Bytes the two strips may take
+         const char *infile            - Binary PPM, PGM, PBM or PAM file
+         const char *factor            - Factor as given, a scale
+         double scale                  - Factor as a number
+         const ResampleOptions *opts   - Resampling options, rgb or gray output
+         uint64_t limit                - Bytes the image, plan and buffers may take
+         const char *filename          - Output file
+   
+   returns: band_rows   nothing
+            band_end    The row after the tallest band from d0 that fits in
+                        room, d0 if not one row does
+            run_strips  -1 if the whole image fits in the limit and nothing was
+                        done, 0 on success, 99 if it can't be done in strips
+   
+   error handling: exits on file errors like readPPM and writePPM
+----------------------------------------------------------------------------*/
+static void band_rows(const ResamplePlan *plan, const double *m, int d0, int d1, int *r0, int *r1) {
+   int e0 = (d0 - plan->halo > 0) ? d0 - plan->halo : 0;
+   int e1 = (d1 + plan->halo < plan->dst_y) ? d1 + plan->halo : plan->dst_y;
+   double lo = INFINITY, hi = -INFINITY, sy;
+   int i;
+
+   if (!m) {
+      *r0 = (plan->yint[e0] - 1 > 0) ? plan->yint[e0] - 1 : 0;
+      *r1 = (plan->yint[e1 - 1] + 3 < plan->src_y) ? plan->yint[e1 - 1] + 3 : plan->src_y;
+      return;
+   }
+
+   // A warp band reads around the source rows of its corners, one row more
+   // each way covers the snap of the positions
+   for (i = 0; i < 4; i++) {
+      sy = m[3] * ((i & 1) ? plan->dst_x - 0.5 : 0.5) + m[4] * ((i & 2) ? e1 - 0.5 : e0 + 0.5) + m[5];
+      if (sy < lo) { lo = sy; }
+      if (sy > hi) { hi = sy; }
+   }
+   lo = floor(lo - 0.5) - 2.0;
+   hi = floor(hi - 0.5) + 4.0;
+   *r0 = (lo > 0.0) ? ((lo < plan->src_y) ? (int)lo : plan->src_y) : 0;
+   *r1 = (hi < plan->src_y) ? ((hi > *r0) ? (int)hi : *r0) : plan->src_y;
+}
+
+static int band_end(const ResamplePlan *plan, const double *m, int d0, size_t src_row, size_t dst_row,
+                    uint64_t room) {
+   int lo = d0, hi = plan->dst_y, mid, r0, r1;
+
+   // A taller band never reads fewer rows, so the tallest that fits is found by halving
+   while (lo < hi) {
+      mid = lo + (hi - lo + 1) / 2;
+      band_rows(plan, m, d0, mid, &r0, &r1);
+      if ((uint64_t)(r1 - r0) * src_row + (uint64_t)(mid - d0) * dst_row <= room) { lo = mid; }
+      else                                                                        { hi = mid - 1; }
+   }
+   return(lo);
+}
+
+static int run_strips(const char *infile, const char *factor, double scale, const ResampleOptions *opts,
+                      uint64_t limit, const char *filename) {
+   unsigned char buff[PPM_HEADER_MAX];
+   PPMImage source_image, destination_image;
+   ResamplePlan *plan;
+   TileScratch scratch;
+   PPMHeader hdr;
+   StageMark mark;
+   struct stat st;
+   const char *err;
+   const double *m = NULL;
+   double affine[6];
+   uint64_t fixed, room, bytes;
+   size_t src_row, dst_row, file_row, got;
+   off_t out_offset;
+   int fd, d0, d1 = 0, r0, r1, p0 = 0, p1 = 0, lo, hi, i;
+   int src_rows = 0, dst_rows = 0, bands = 0, was_quiet = quiet, status = 0;
+   FILE *fp;
+
+   //read and parse the header, the raster is read a band at a time
+   fd = open(infile, O_RDONLY);
+   if (fd < 0 || fstat(fd, &st)) {
+      fprintf(stderr, "Unable to open file '%s'\n", infile);
+      exit(1);
+   }
+   got = ((uint64_t)st.st_size < sizeof(buff)) ? (size_t)st.st_size : sizeof(buff);
+   err = pread_full(fd, buff, got, 0) ? "Error reading header" : parse_ppm_header(buff, got, &hdr);
+   if (err) {
+      fprintf(stderr, "%s (error loading '%s')\n", err, infile);
+      exit(1);
+   }
+
+   memset(&source_image, 0, sizeof(source_image));
+   source_image.x = hdr.x;
+   source_image.y = hdr.y;
+   source_image.channels = hdr.channels;
+   source_image.maxval = hdr.maxval;
+   if (!output_fits(factor, scale, &source_image)) {
+      printf("error output size out of range\n");
+      close(fd);
+      return(99);
+   }
+   destination_image = source_image;
+   size_destination(&source_image, scale, opts->output, &destination_image);
+   src_row = (size_t)source_image.x * image_pixel_bytes(&source_image);
+   dst_row = (size_t)destination_image.x * image_pixel_bytes(&destination_image);
+   file_row = (hdr.format == '4') ? ((size_t)source_image.x + 7) / 8 : src_row;
+
+   // The plan stays in the cache for the jobs of the bands
+   plan_cache.enabled = 1;
+   plan = acquire_plan(source_image.x, source_image.y, destination_image.x, destination_image.y,
+                       source_image.channels, opts);
+   fixed = (uint64_t)(plan->dst_x + plan->dst_y) * 2 * sizeof(int) +
+           (uint64_t)(plan->phases_x + plan->phases_y) * CUBIC_TAPS * (sizeof(double) + sizeof(float));
+   if (opts->tile_x >= 0) {
+      fixed += (uint64_t)scratch_size(plan, &scratch) * (scheduler ? scheduler->workers : 1);
+   }
+   if (opts->linear) {
+      fixed += (uint64_t)(source_image.maxval + 1) * sizeof(float) + LINEAR_LUT_SIZE;
+   }
+   room = (limit > fixed) ? limit - fixed : 0;
+   if (opts->warp != WARP_NONE) {
+      warp_matrix(opts, &source_image, &destination_image, affine);
+      m = affine;
+   }
+
+   if ((uint64_t)src_row * source_image.y + (uint64_t)dst_row * destination_image.y <= room) {
+      status = -1;
+   }
+   else if (hdr.format <= '3') {
+      printf("error %s is a plain image, only binary images are read in strips\n", infile);
+      status = 99;
+   }
+   else if ((uint64_t)hdr.offset > (uint64_t)st.st_size ||
+            (uint64_t)(st.st_size - hdr.offset) < (uint64_t)file_row * source_image.y) {
+      fprintf(stderr, "Truncated image data (error loading '%s')\n", infile);
+      exit(1);
+   }
+   else {
+      // Size the strips for the tallest bands
+      for (d0 = 0; d0 < destination_image.y; d0 = d1) {
+         d1 = band_end(plan, m, d0, src_row, dst_row, room);
+         if (d1 == d0) { break; }
+         band_rows(plan, m, d0, d1, &r0, &r1);
+         if (r1 - r0 > src_rows) { src_rows = r1 - r0; }
+         if (d1 - d0 > dst_rows) { dst_rows = d1 - d0; }
+         bands++;
+      }
+      if (d0 < destination_image.y) {
+         // Report the most any band of one row needs, the edge bands read fewer rows
+         for (d0 = 0, bytes = 0; d0 < destination_image.y; d0++) {
+            band_rows(plan, m, d0, d0 + 1, &r0, &r1);
+            if ((uint64_t)(r1 - r0) * src_row + dst_row > bytes) { bytes = (uint64_t)(r1 - r0) * src_row + dst_row; }
+         }
+         printf("error memory limit too small, a band of one output row needs %llu bytes\n",
+                (unsigned long long)(bytes + fixed));
+         status = 99;
+      }
+   }
+   if (status) {
+      close(fd);
+      release_plan(plan);
+      flush_plan_cache();
+      return(status);
+   }
+
+   printf("Resampling %dx%d to %dx%d in %d strips of up to %d output rows\n", source_image.x,
+          source_image.y, destination_image.x, destination_image.y, bands, dst_rows);
+   source_image.data = (unsigned char *)malloc((size_t)(src_rows ? src_rows : 1) * src_row);
+   destination_image.data = (unsigned char *)malloc((size_t)dst_rows * dst_row);
+   if (!source_image.data || !destination_image.data) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   fp = fopen(filename, "wb");
+   if (!fp) {
+      fprintf(stderr, "Unable to open file '%s'\n", filename);
+      exit(1);
+   }
+   write_ppm_header(fp, &destination_image, 0);
+   out_offset = (off_t)ftell(fp);
+   if (out_offset <= 0 || fflush(fp)) {
+      fprintf(stderr, "Error writing file '%s'\n", filename);
+      exit(1);
+   }
+
+   // The bands are done one after another, each on all the workers
+   quiet = 1;
+   for (d0 = 0; d0 < destination_image.y; d0 = d1) {
+      ImageRect band;
+      int span[2][2];
+
+      d1 = band_end(plan, m, d0, src_row, dst_row, room);
+      band_rows(plan, m, d0, d1, &r0, &r1);
+      band.x0 = 0;
+      band.y0 = d0;
+      band.x1 = destination_image.x;
+      band.y1 = d1;
+
+      // Keep the source rows the band before shares with this one and read the rest
+      stats_begin(&mark);
+      lo = (p0 > r0) ? p0 : r0;
+      hi = (p1 < r1) ? p1 : r1;
+      if (lo < hi) {
+         memmove(source_image.data + (size_t)(lo - r0) * src_row, source_image.data + (size_t)(lo - p0) * src_row,
+                 (size_t)(hi - lo) * src_row);
+      }
+      else {
+         lo = hi = r1;
+      }
+      span[0][0] = r0;
+      span[0][1] = lo;
+      span[1][0] = hi;
+      span[1][1] = r1;
+      for (i = 0, bytes = 0; i < 2; i++) {
+         unsigned char *at = source_image.data + (size_t)(span[i][0] - r0) * src_row;
+         int rows = span[i][1] - span[i][0];
+
+         if (rows <= 0) { continue; }
+         if (pread_full(fd, at, (size_t)rows * file_row, hdr.offset + (off_t)span[i][0] * (off_t)file_row)) {
+            fprintf(stderr, "Error loading image '%s'\n", infile);
+            exit(1);
+         }
+         if (hdr.format == '4') {
+            unpack_pbm(at, source_image.x, rows);
+         }
+         else {
+            if (image_wide(&source_image)) {
+               swap_samples16((uint16_t *)at, (uint16_t *)at, (size_t)rows * src_row / 2);
+            }
+            if (check_maxval(at, (size_t)rows * source_image.x * source_image.channels, source_image.maxval)) {
+               fprintf(stderr, "Sample larger than maxval (error loading '%s')\n", infile);
+               exit(1);
+            }
+         }
+         bytes += (uint64_t)rows * file_row;
+      }
+      stats_end(STAGE_READ, &mark, bytes, 0);
+      source_image.top = p0 = r0;
+      p1 = r1;
+
+      destination_image.top = d0;
+      resample_finish(start_job(&source_image, &destination_image, opts, &band, 1, 1));
+
+      // 16 bit samples are swapped to big endian in place, the strip is done with
+      stats_begin(&mark);
+      bytes = (uint64_t)(d1 - d0) * dst_row;
+      if (image_wide(&destination_image)) {
+         swap_samples16((uint16_t *)destination_image.data, (uint16_t *)destination_image.data, (size_t)bytes / 2);
+      }
+      if (pwrite_full(fileno(fp), destination_image.data, (size_t)bytes, out_offset + (off_t)d0 * (off_t)dst_row)) {
+         fprintf(stderr, "Error writing file '%s'\n", filename);
+         exit(1);
+      }
+      stats_end(STAGE_WRITE, &mark, bytes, 0);
+   }
+   quiet = was_quiet;
+
+   if (fclose(fp)) {
+      fprintf(stderr, "Error writing file '%s'\n", filename);
+      exit(1);
+   }
+   close(fd);
+   free(source_image.data);
+   free(destination_image.data);
+   release_plan(plan);
+   flush_plan_cache();
+   return(0);
+}
+
+
+/*---------------------------------------------------------------------------
+   These functions parse an alignment, center or corner, an engine, float
+   or double, a tile size, off, auto or WxH, an unsharp mask,
+   amount[,radius[,threshold]], an output mode, rgb, gray or ycbcr420, an
+   affine warp matrix, a,b,c,d,e,f, and a rotation in degrees
+   
+      const char *text        - Alignment, engine, tile size, sharpen, output, matrix or angle text
+      ResampleOptions *opts   - Options to set
+  
+   Returns: int  0 on success, -1 for a bad value
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int parse_align(const char *text, ResampleOptions *opts) {
+   if (strcmp(text, "center") == 0) { opts->align = ALIGN_CENTER; }
+   else if (strcmp(text, "corner") == 0) { opts->align = ALIGN_CORNER; }
+   else { return(-1); }
+   return(0);
+}
+
+static int parse_engine(const char *text, ResampleOptions *opts) {
+   if (strcmp(text, "float") == 0) { opts->engine = ENGINE_FLOAT; }
+   else if (strcmp(text, "double") == 0) { opts->engine = ENGINE_DOUBLE; }
+   else { return(-1); }
+   return(0);
+}
+
+static int parse_output(const char *text, ResampleOptions *opts) {
+   if (strcmp(text, "rgb") == 0) { opts->output = OUTPUT_RGB; }
+   else if (strcmp(text, "gray") == 0) { opts->output = OUTPUT_GRAY; }
+   else if (strcmp(text, "ycbcr420") == 0) { opts->output = OUTPUT_YCBCR420; }
+   else { return(-1); }
+   return(0);
+}
+
+static int parse_sharpen(const char *text, ResampleOptions *opts) {
+   double amount, radius = DEFAULT_SHARPEN_RADIUS, threshold = 0.0;
+   char *end;
+
+   amount = strtod(text, &end);
+   if (end != text && *end == ',') {
+      radius = strtod(end + 1, &end);
+      if (*end == ',') { threshold = strtod(end + 1, &end); }
+   }
+   if (end == text || *end || !(amount >= 0.0) || !(radius > 0.0 && radius <= MAX_SHARPEN_RADIUS) ||
+       !(threshold >= 0.0)) {
+      return(-1);
+   }
+   // No sharpening is one setting whatever the radius, for the cache keys
+   opts->amount = amount;
+   opts->radius = (amount > 0.0) ? radius : 0.0;
+   opts->threshold = (amount > 0.0) ? threshold : 0.0;
+   return(0);
+}
+
+static int parse_affine(const char *text, ResampleOptions *opts) {
+   double m[6];
+   char *end = (char *)text;
+   int i;
+
+   for (i = 0; i < 6; i++) {
+      const char *start = (i == 0) ? text : end + 1;
+
+      if (i > 0 && *end != ',') { return(-1); }
+      m[i] = strtod(start, &end);
+      if (end == start || !isfinite(m[i])) { return(-1); }
+   }
+   if (*end) { return(-1); }
+   memcpy(opts->affine, m, sizeof(m));
+   opts->warp = WARP_AFFINE;
+   return(0);
+}
+
+static int parse_rotate(const char *text, ResampleOptions *opts) {
+   char *end;
+   double angle = strtod(text, &end);
+
+   if (end == text || *end || !isfinite(angle)) { return(-1); }
+   opts->angle = angle;
+   opts->warp = WARP_ROTATE;
+   return(0);
+}
+
+static int parse_tile(const char *text, ResampleOptions *opts) {
+   if (strcmp(text, "off") == 0) { opts->tile_x = opts->tile_y = -1; }
+   else if (strcmp(text, "auto") == 0) { opts->tile_x = opts->tile_y = 0; }
+   else if (sscanf(text, "%dx%d", &opts->tile_x, &opts->tile_y) != 2 || 
+            opts->tile_x <= 0 || opts->tile_y <= 0) {
+      return(-1);
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function parses changed source rectangles, x,y,w,h with more
+   rectangles after a colon
+   
+      const char *text        - Rectangle list
+      ImageRect **rects       - Returned malloced rectangles
+      int *count              - Returned number of rectangles
+  
+   Returns: int  0 on success, -1 for a bad list
+   
+   Error Handling:   returns an error code, exits if memory runs out
+----------------------------------------------------------------------------*/
+static int parse_changed(const char *text, ImageRect **rects, int *count) {
+   const char *p;
+   int n = 1, used, x, y, w, h;
+
+   for (p = text; *p; p++) {
+      if (*p == ':') { n++; }
+   }
+   *rects = (ImageRect *)malloc(n * sizeof(ImageRect));
+   if (!*rects) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+
+   for (*count = 0, p = text; *count < n; p += used + 1) {
+      if (sscanf(p, "%d,%d,%d,%d%n", &x, &y, &w, &h, &used) != 4 || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+          w > PPM_MAX_DIMENSION || h > PPM_MAX_DIMENSION || (p[used] && p[used] != ':')) {
+         free(*rects);
+         *rects = NULL;
+         return(-1);
+      }
+      (*rects)[*count].x0 = x;
+      (*rects)[*count].y0 = y;
+      (*rects)[*count].x1 = (x < PPM_MAX_DIMENSION) ? x + w : PPM_MAX_DIMENSION;
+      (*rects)[*count].y1 = (y < PPM_MAX_DIMENSION) ? y + h : PPM_MAX_DIMENSION;
+      (*count)++;
+   }
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function fills in a Unix domain socket address
+   
+      const char *path           - Socket file name
+      struct sockaddr_un *addr   - Address to fill in
+  
+   Returns: int  0 on success, -1 if the path is too long
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+   memset(addr, 0, sizeof(*addr));
+   if (strlen(path) >= sizeof(addr->sun_path)) { return(-1); }
+   addr->sun_family = AF_UNIX;
+   strcpy(addr->sun_path, path);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   These functions read from a client connection.  Reads go through recvmsg
+   so descriptors passed with SCM_RIGHTS are kept, in the order they
+   arrive, for the requests that name them.
+   
+      ServerConnection *conn  - The connection
+      char *line              - Returned request line
+      void *buf               - Buffer for the bytes read
+      size_t size             - Size of line / bytes to read
+  
+   Returns: conn_recv       Bytes read, 0 at the end, -1 on errors
+            conn_read_line  1 for a line, 0 at the end, -1 if it is too long
+            conn_read       0 on success, -1 if the connection ends early
+            conn_take_fd    Next passed descriptor, -1 if there is none
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static ssize_t conn_recv(ServerConnection *conn, void *buf, size_t size) {
+   union {
+      struct cmsghdr align;
+      char space[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+   } control;
+   struct iovec iov;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   ssize_t got;
+   int i, n, fd;
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = buf;
+   iov.iov_len = size;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control.space;
+   msg.msg_controllen = sizeof(control.space);
+   do {
+      got = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+   } while (got < 0 && errno == EINTR);
+
+   for (cmsg = CMSG_FIRSTHDR(&msg); got >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) { continue; }
+      n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      for (i = 0; i < n; i++) {
+         memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+         if (conn->nfds < MAX_PASSED_FDS) { conn->fds[conn->nfds++] = fd; }
+         else                             { close(fd); }
+      }
+   }
+   return(got);
+}
+
+static int conn_read_line(ServerConnection *conn, char *line, size_t size) {
+   unsigned char *nl;
+   size_t len;
+   ssize_t got;
+
+   for (;;) {
+      nl = (unsigned char *)memchr(conn->buf + conn->start, '\n', conn->end - conn->start);
+      if (nl) {
+         len = (size_t)(nl - (conn->buf + conn->start));
+         if (len >= size) { return(-1); }
+         memcpy(line, conn->buf + conn->start, len);
+         line[len] = '\0';
+         conn->start += len + 1;
+         return(1);
+      }
+
+      // Move the partial line to the front and read more
+      memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+      conn->end -= conn->start;
+      conn->start = 0;
+      if (conn->end == sizeof(conn->buf)) { return(-1); }
+      got = conn_recv(conn, conn->buf + conn->end, sizeof(conn->buf) - conn->end);
+      if (got <= 0) { return(0); }
+      conn->end += (size_t)got;
+   }
+}
+
+static int conn_read(ServerConnection *conn, void *buf, size_t size) {
+   size_t have = conn->end - conn->start;
+   ssize_t got;
+
+   // Bytes already read ahead come first
+   if (have > size) { have = size; }
+   memcpy(buf, conn->buf + conn->start, have);
+   conn->start += have;
+   while (have < size) {
+      got = conn_recv(conn, (unsigned char *)buf + have, size - have);
+      if (got <= 0) { return(-1); }
+      have += (size_t)got;
+   }
+   return(0);
+}
+
+static int conn_take_fd(ServerConnection *conn) {
+   int fd;
+
+   if (conn->nfds == 0) { return(-1); }
+   fd = conn->fds[0];
+   memmove(conn->fds, conn->fds + 1, --conn->nfds * sizeof(int));
+   return(fd);
+}
+
+/*---------------------------------------------------------------------------
+   This function maps a raw raster in a descriptor passed by a client, so
+   the resample reads or writes the client's memory directly.  The raster
+   is laid out like PPMImage data, 16 bit samples in host order, starting
+   offset bytes into the descriptor with stride bytes from row to row.
+   The descriptor must be a memfd sealed against shrinking, since a client
+   truncating it under the mapping would kill the server with SIGBUS, and
+   an input must be sealed against writes too so the samples checked
+   against maxval can't change during the resample.
+   
+      int fd              - Passed descriptor, a sealed memfd
+      PPMImage *img       - Sizes and stride filled in, data is set here
+      uint64_t offset     - Byte offset of the first row
+      int writable        - Map for writing the destination
+      void **map          - Returned mapping to munmap
+      size_t *map_size    - Returned mapping size
+  
+   Returns: const char *  NULL on success, else an error message
+   
+   Error Handling:   returns an error message
+----------------------------------------------------------------------------*/
+static const char *map_shared_image(int fd, PPMImage *img, uint64_t offset, int writable,
+                                    void **map, size_t *map_size) {
+   uint64_t row, need, base;
+   struct stat st;
+   long page;
+   int seals;
+
+   if (img->x < 1 || img->y < 1 || img->x > PPM_MAX_DIMENSION || img->y > PPM_MAX_DIMENSION ||
+       img->channels < 1 || img->channels > MAX_CHANNELS ||
+       img->maxval < 1 || img->maxval > MAX_COMPONENT_COLOR) {
+      return("Bad shared image description");
+   }
+   row = (uint64_t)img->x * image_pixel_bytes(img);
+   if (img->stride == 0) { img->stride = (size_t)row; }
+   if (img->stride < row || img->stride > ((uint64_t)1 << 40) || offset > ((uint64_t)1 << 62)) {
+      return("Bad shared image stride");
+   }
+   if (image_wide(img) && ((offset | img->stride) & 1)) {
+      return("Shared 16 bit rows must be 2 byte aligned");
+   }
+
+   seals = fcntl(fd, F_GET_SEALS);
+   if (seals < 0 || !(seals & F_SEAL_SHRINK) || (!writable && !(seals & F_SEAL_WRITE))) {
+      return(writable ? "Shared output must be a memfd sealed with F_SEAL_SHRINK"
+                      : "Shared input must be a memfd sealed with F_SEAL_SHRINK and F_SEAL_WRITE");
+   }
+
+   need = offset + (uint64_t)img->stride * (img->y - 1) + row;
+   if (fstat(fd, &st) || (uint64_t)st.st_size < need) {
+      return("Shared image is larger than its descriptor");
+   }
+
+   page = sysconf(_SC_PAGESIZE);
+   base = offset - offset % (uint64_t)page;
+   *map_size = (size_t)(need - base);
+   *map = mmap(NULL, *map_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, (off_t)base);
+   if (*map == MAP_FAILED) {
+      *map = NULL;
+      return("Unable to map shared image");
+   }
+   img->data = (unsigned char *)*map + (offset - base);
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+   This function serves one request line from a client.  A request is a
+   list of key=value words:
+      scale=F|2x|2up|4up   resample factor or a quick kernel
+      in=FILE|@N|fd     input file, N bytes of image sent after the line, or
+                        a descriptor passed with the line
+      out=FILE|@|fd     output file, @ to send the image back, or a passed
+                        descriptor to write the raw raster into
+      linear=0|1  tile=off|auto|WxH  align=center|corner  engine=float|double
+      sharpen=amount[,radius[,threshold]]  output=rgb|gray
+      affine=a,b,c,d,e,f  rotate=degrees  fill=N
+      ascii=0|1         per request options
+   or a single 'ping', 'stats' or 'shutdown' word.  An input descriptor holds a PPM
+   file, or a raw raster described by width=W height=H and optionally
+   channels=C maxval=M stride=BYTES offset=BYTES.  An output descriptor gets
+   a raw raster of the resampled size, with out_stride and out_offset.  Raw
+   raster descriptors must be memfds sealed as map_shared_image describes.
+   Descriptors are taken in the order they were passed, input first.  The
+   reply is a line "OK N" followed by N bytes of image, or "ERR message".
+   
+      Server *server          - The server
+      ServerConnection *conn  - Connection to read inline images from
+      FILE *out               - Connection output stream
+      char *line              - Request line, changed by the parse
+  
+   Returns: int  1 to keep the connection open, 0 to close it
+   
+   Error Handling:   errors are sent to the client, the connection is
+                     closed if an inline image can't be skipped
+----------------------------------------------------------------------------*/
+static int serve_request(Server *server, ServerConnection *conn, FILE *out, char *line) {
+   ResampleOptions opts = *server->defaults;
+   const char *factor = NULL, *input = NULL, *output = NULL, *err = NULL;
+   PPMSource src = { -1, NULL, 0 };
+   PPMImage *source_image = NULL, *destination_image = NULL;
+   PPMImage shared_in = { 0, 0, 3, RGB_COMPONENT_COLOR, NULL, 0, 0 };
+   PPMImage shared_out = { 0, 0, 0, 0, NULL, 0, 0 };
+   unsigned char *inline_data = NULL;
+   char *word, *next, *value, *end, *reply = NULL;
+   size_t reply_size = 0, in_map_size = 0, out_map_size = 0;
+   uint64_t inline_size = 0, in_offset = 0, out_offset = 0, key = 0;
+   void *in_map = NULL, *out_map = NULL;
+   double scale = 0.0;
+   long dst_x, dst_y;
+   int ascii = 0, in_fd = -1, out_fd = -1, y;
+   struct stat st;
+   FILE *fp;
+
+   for (word = strtok_r(line, " \t\r\n", &next); word; word = strtok_r(NULL, " \t\r\n", &next)) {
+      value = strchr(word, '=');
+      if (!value) {
+         if (strcmp(word, "ping") == 0 && !factor && !input && !output) {
+            fprintf(out, "OK 0\n");
+            return(1);
+         }
+         if (strcmp(word, "stats") == 0 && !factor && !input && !output) {
+            fprintf(out, "OK 0 hits=%d misses=%d evictions=%d\n", atomic_load(&output_cache.hits),
+                    atomic_load(&output_cache.misses), output_cache.evictions);
+            return(1);
+         }
+         if (strcmp(word, "shutdown") == 0 && !factor && !input && !output) {
+            pthread_mutex_lock(&server->lock);
+            server->stopping = 1;
+            shutdown(server->listen_fd, SHUT_RDWR);
+            pthread_mutex_unlock(&server->lock);
+            fprintf(out, "OK 0\n");
+            return(0);
+         }
+         if (!err) { err = "Bad request word"; }
+         continue;
+      }
+      *value++ = '\0';
+      if (strcmp(word, "scale") == 0) { factor = value; }
+      else if (strcmp(word, "in") == 0) { input = value; }
+      else if (strcmp(word, "out") == 0) { output = value; }
+      else if (strcmp(word, "linear") == 0) { opts.linear = atoi(value); }
+      else if (strcmp(word, "align") == 0) {
+         if (parse_align(value, &opts) && !err) { err = "Bad align, use center or corner"; }
+      }
+      else if (strcmp(word, "engine") == 0) {
+         if (parse_engine(value, &opts) && !err) { err = "Bad engine, use float or double"; }
+      }
+      else if (strcmp(word, "affine") == 0) {
+         if (parse_affine(value, &opts) && !err) { err = "Bad affine, use a,b,c,d,e,f"; }
+      }
+      else if (strcmp(word, "rotate") == 0) {
+         if (parse_rotate(value, &opts) && !err) { err = "Bad rotate, use an angle in degrees"; }
+      }
+      else if (strcmp(word, "fill") == 0) {
+         opts.fill = atoi(value);
+         if ((opts.fill < 0 || opts.fill > MAX_COMPONENT_COLOR) && !err) { err = "Bad fill"; }
+      }
+      else if (strcmp(word, "output") == 0) {
+         if ((parse_output(value, &opts) || opts.output == OUTPUT_YCBCR420) && !err) {
+            err = "Bad output, use rgb or gray, ycbcr420 is only written to files by --output";
+         }
+      }
+      else if (strcmp(word, "sharpen") == 0) {
+         if (parse_sharpen(value, &opts) && !err) { err = "Bad sharpen, use amount[,radius[,threshold]]"; }
+      }
+      else if (strcmp(word, "ascii") == 0) { ascii = atoi(value); }
+      else if (strcmp(word, "tile") == 0) {
+         if (parse_tile(value, &opts) && !err) { err = "Bad tile size"; }
+      }
+      else if (strcmp(word, "width") == 0) { shared_in.x = atoi(value); }
+      else if (strcmp(word, "height") == 0) { shared_in.y = atoi(value); }
+      else if (strcmp(word, "channels") == 0) { shared_in.channels = atoi(value); }
+      else if (strcmp(word, "maxval") == 0) { shared_in.maxval = atoi(value); }
+      else if (strcmp(word, "stride") == 0) { shared_in.stride = (size_t)strtoull(value, NULL, 10); }
+      else if (strcmp(word, "offset") == 0) { in_offset = strtoull(value, NULL, 10); }
+      else if (strcmp(word, "out_stride") == 0) { shared_out.stride = (size_t)strtoull(value, NULL, 10); }
+      else if (strcmp(word, "out_offset") == 0) { out_offset = strtoull(value, NULL, 10); }
+      else if (!err) { err = "Unknown request key"; }
+   }
+
+   // Passed descriptors are taken even after an error to keep them in step
+   if (input && strcmp(input, "fd") == 0) {
+      in_fd = conn_take_fd(conn);
+      if (in_fd < 0 && !err) { err = "No input descriptor passed"; }
+   }
+   if (output && strcmp(output, "fd") == 0) {
+      out_fd = conn_take_fd(conn);
+      if (out_fd < 0 && !err) { err = "No output descriptor passed"; }
+   }
+
+   // Inline images are read even after an error to keep the stream in step
+   if (input && input[0] == '@') {
+      inline_size = strtoull(input + 1, &end, 10);
+      if (end == input + 1 || *end || inline_size > MAX_INLINE_BYTES) {
+         fprintf(out, "ERR Bad inline image size\n");
+         return(0);
+      }
+      inline_data = (unsigned char *)pool_alloc((size_t)inline_size);
+      if (conn_read(conn, inline_data, (size_t)inline_size)) {
+         pool_free(inline_data, (size_t)inline_size);
+         if (in_fd >= 0) { close(in_fd); }
+         if (out_fd >= 0) { close(out_fd); }
+         return(0);
+      }
+      src.mem = inline_data;
+      src.size = inline_size;
+   }
+
+   if (!err && (!factor || !input || !output)) { err = "Request needs scale, in and out"; }
+   if (!err) {
+      scale = atof(factor);
+      if (!is_quick(factor) && (scale <= 0.0)) { err = "Scale must be positive"; }
+      else { err = option_conflict(factor, &opts); }
+   }
+
+   // Map a raw shared raster, or load a PPM from the inline bytes, the
+   // passed descriptor or the file
+   if (!err && in_fd >= 0 && shared_in.x) {
+      err = map_shared_image(in_fd, &shared_in, in_offset, 0, &in_map, &in_map_size);
+      for (y = 0; !err && y < shared_in.y; y++) {
+         err = check_maxval(image_row(&shared_in, y), (size_t)shared_in.x * shared_in.channels, shared_in.maxval);
+      }
+      if (!err) { source_image = &shared_in; }
+   }
+   else if (!err) {
+      if (in_fd >= 0) {
+         src.fd = in_fd;
+         in_fd = -1;
+      }
+      else if (!src.mem) {
+         src.fd = open(input, O_RDONLY);
+      }
+      if (!src.mem && (src.fd < 0 || fstat(src.fd, &st))) { err = "Unable to open input file"; }
+      else if (!src.mem) { src.size = (uint64_t)st.st_size; }
+      if (!err) { source_image = load_ppm(&src, &err); }
+   }
+   if (src.fd >= 0) { close(src.fd); }
+
+   if (!err) {
+      dst_x = factor_size(factor, scale, source_image->x);
+      dst_y = factor_size(factor, scale, source_image->y);
+      if (!output_fits(factor, scale, source_image)) { err = "Output size out of range"; }
+   }
+
+   // A shared destination is mapped and written in place
+   if (!err && out_fd >= 0) {
+      shared_out.x = (int)dst_x;
+      shared_out.y = (int)dst_y;
+      shared_out.channels = (opts.output == OUTPUT_GRAY) ? 1 : source_image->channels;
+      shared_out.maxval = source_image->maxval;
+      err = map_shared_image(out_fd, &shared_out, out_offset, 1, &out_map, &out_map_size);
+      if (!err && output_cache.dir) {
+         key = cache_key(source_image, factor, scale, &opts);
+         destination_image = cache_lookup(key, &shared_out);
+      }
+      if (destination_image) {
+         copy_image_rows(&shared_out, destination_image);
+      }
+      else if (!err) {
+         if (strcmp(factor, "2x") == 0) { resize2_into(source_image, &shared_out); }
+         else if (quick_up(factor))     { resize_up_into(source_image, &shared_out, quick_up(factor)); }
+         else                           { resize_image(source_image, &shared_out, &opts); }
+         if (output_cache.dir) { cache_store(key, &shared_out); }
+      }
+   }
+   else if (!err) {
+      destination_image = resample_cached(source_image, factor, scale, &opts);
+
+      // Send the image back or write the file
+      if (strcmp(output, "@") == 0) {
+         fp = open_memstream(&reply, &reply_size);
+         if (!fp) { err = "Unable to allocate memory"; }
+      }
+      else {
+         fp = fopen(output, "wb");
+         if (!fp) { err = "Unable to open output file"; }
+      }
+      if (fp) {
+         write_ppm_stream(fp, destination_image, ascii);
+         if (fclose(fp)) { err = "Error writing output"; }
+      }
+   }
+
+   if (err) {
+      fprintf(out, "ERR %s\n", err);
+   }
+   else {
+      fprintf(out, "OK %lu\n", (unsigned long)reply_size);
+      if (reply) { fwrite(reply, 1, reply_size, out); }
+   }
+
+   free(reply);
+   pool_free(inline_data, (size_t)inline_size);
+   if (source_image != &shared_in) { free_image(source_image); }
+   free_image(destination_image);
+   if (in_map) { munmap(in_map, in_map_size); }
+   if (out_map) { munmap(out_map, out_map_size); }
+   if (in_fd >= 0) { close(in_fd); }
+   if (out_fd >= 0) { close(out_fd); }
+   return(1);
+}
+
+/*---------------------------------------------------------------------------
+   This is the thread for one client connection.  Requests are served one
+   after another until the client closes the connection.
+   
+      void *arg   - Pointer to a malloced ServerConnection
+  
+   Returns: NULL
+   
+   Error Handling:   the connection is closed on errors
+----------------------------------------------------------------------------*/
+static void *connection_thread(void *arg) {
+   ServerConnection *conn = (ServerConnection *)arg;
+   Server *server = conn->server;
+   char line[BATCH_LINE_SIZE];
+   FILE *out = NULL;
+   int keep = 1, fd, got;
+
+   fd = dup(conn->fd);
+   if (fd >= 0) { out = fdopen(fd, "w"); }
+   if (!out) {
+      if (fd >= 0) { close(fd); }
+      close(conn->fd);
+      free(conn);
+      return(NULL);
+   }
+
+   while (keep && (got = conn_read_line(conn, line, sizeof(line))) != 0) {
+      if (got < 0) {
+         fprintf(out, "ERR Request line too long\n");
+         break;
+      }
+
+      pthread_mutex_lock(&server->lock);
+      if (server->stopping) {
+         pthread_mutex_unlock(&server->lock);
+         fprintf(out, "ERR Server shutting down\n");
+         break;
+      }
+      server->busy++;
+      pthread_mutex_unlock(&server->lock);
+
+      keep = serve_request(server, conn, out, line);
+      if (fflush(out)) { keep = 0; }
+
+      pthread_mutex_lock(&server->lock);
+      if (--server->busy == 0) { pthread_cond_broadcast(&server->idle); }
+      pthread_mutex_unlock(&server->lock);
+   }
+
+   while (conn->nfds) { close(conn_take_fd(conn)); }
+   close(conn->fd);
+   fclose(out);
+   free(conn);
+   return(NULL);
+}
+
+/*---------------------------------------------------------------------------
+   This function runs the resample server.  It listens on a Unix domain
+   socket and serves each connection on its own thread, all of them sharing
+   the worker pool, the buffer pool and the plan cache so repeated requests
+   skip the setup.  It returns after a shutdown request once the requests
+   in progress are done.  Requests name files the server opens as its own
+   user, so the socket is created readable and writable by that user only.
+   
+      const char *path              - Socket file name
+      const ResampleOptions *opts   - Default resampling options
+  
+   Returns: int  0 after a shutdown request
+   
+   Error Handling:   exits if the socket can't be set up
+----------------------------------------------------------------------------*/
+static int run_server(const char *path, const ResampleOptions *opts) {
+   struct sockaddr_un addr;
+   ServerConnection *conn;
+   pthread_attr_t attr;
+   pthread_t thread;
+   Server server;
+   mode_t mask;
+   int fd, i;
+
+   memset(&server, 0, sizeof(server));
+   server.defaults = opts;
+   pthread_mutex_init(&server.lock, NULL);
+   pthread_cond_init(&server.idle, NULL);
+
+   if (socket_address(path, &addr)) {
+      fprintf(stderr, "Socket name too long '%s'\n", path);
+      exit(1);
+   }
+   signal(SIGPIPE, SIG_IGN);
+   unlink(path);
+   server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   // The socket is 0600 from the start, a chmod after bind leaves a window
+   mask = umask(0177);
+   i = (server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)));
+   umask(mask);
+   if (i || listen(server.listen_fd, LISTEN_BACKLOG)) {
+      perror(path);
+      exit(1);
+   }
+
+   quiet = 1;
+   buffer_pool.enabled = 1;
+   plan_cache.enabled = 1;
+   printf("Serving on %s\n", path);
+   fflush(stdout);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (;;) {
+      fd = accept(server.listen_fd, NULL, NULL);
+      if (fd < 0) {
+         pthread_mutex_lock(&server.lock);
+         i = server.stopping;
+         pthread_mutex_unlock(&server.lock);
+         if (i || (errno != EINTR && errno != ECONNABORTED)) { break; }
+         continue;
+      }
+      conn = (ServerConnection *)calloc(1, sizeof(ServerConnection));
+      if (!conn) {
+         fprintf(stderr, "Unable to allocate memory\n");
+         exit(1);
+      }
+      conn->server = &server;
+      conn->fd = fd;
+      if (pthread_create(&thread, &attr, connection_thread, conn)) {
+         close(fd);
+         free(conn);
+      }
+   }
+   pthread_attr_destroy(&attr);
+
+   // Wait for requests in progress, idle connections are dropped at exit
+   pthread_mutex_lock(&server.lock);
+   server.stopping = 1;
+   while (server.busy) {
+      pthread_cond_wait(&server.idle, &server.lock);
+   }
+   pthread_mutex_unlock(&server.lock);
+   close(server.listen_fd);
+   unlink(path);
+
+   flush_plan_cache();
+   pthread_mutex_lock(&buffer_pool.lock);
+   while (buffer_pool.count) {
+      free(buffer_pool.entry[--buffer_pool.count].ptr);
+   }
+   buffer_pool.enabled = 0;
+   pthread_mutex_unlock(&buffer_pool.lock);
+   return(0);
+}
+
+/*---------------------------------------------------------------------------
+   This function connects to a server's socket
+   
+      const char *path  - Socket file name
+  
+   Returns: int  Connected socket, -1 on error
+   
+   Error Handling:   returns an error code
+----------------------------------------------------------------------------*/
+static int connect_socket(const char *path) {
+   struct sockaddr_un addr;
+   int fd;
+
+   if (socket_address(path, &addr)) { return(-1); }
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      close(fd);
+      fd = -1;
+   }
+   return(fd);
+}
+
+/*---------------------------------------------------------------------------
+   This function builds a request from command line words for the client
+   and load generator.  Words are sent as they are except:
+      in=@FILE     sends FILE inline after the line
+      out=@FILE    asks for the image back and saves it in FILE
+      in=mem:FILE  loads FILE into a memfd passed to the server as a raw raster
+      out=mem:FILE passes a memfd for the server to resample into, saved in FILE
+   out=mem needs in=mem so the output size is known here.
+   
+      int count               - Number of words
+      char *words[]           - The words
+      ClientRequest *req      - Returned request, free with free_client_request
+  
+   Returns: nothing
+   
+   Error Handling:   exits if a file can't be read or memory runs out
+----------------------------------------------------------------------------*/
+static void client_request_line(int count, char *words[], ClientRequest *req) {
+   const char *factor = NULL, *shared_save = NULL;
+   PPMImage *source = NULL;
+   size_t size = 0;
+   struct stat st;
+   void *map;
+   FILE *fp;
+   int i, fd, in_fd = -1, out_fd = -1, gray = 0;
+
+   memset(req, 0, sizeof(*req));
+   fp = open_memstream(&req->line, &size);
    if (!fp) {
-       fprintf(stderr, "Unable to open file '%s'\n", filename);
-       exit(1);
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
    }
 
-   //write the header file as ascii data on each line
-   //image format
-   fprintf(fp, "P6\n");
-
-   //comments
-   fprintf(fp, "# Created by %s\n",CREATOR);
+   for (i = 0; i < count; i++) {
+      const char *word = words[i];
 
-   //image size
-   fprintf(fp, "%d %d\n",img->x,img->y);
+      if (i) { fputc(' ', fp); }
+      if (strncmp(word, "scale=", 6) == 0) { factor = word + 6; }
+      if (strncmp(word, "output=", 7) == 0) { gray = (strcmp(word + 7, "gray") == 0); }
 
-   // rgb component depth
-   fprintf(fp, "%d\n",RGB_COMPONENT_COLOR);
+      if (strncmp(word, "in=@", 4) == 0 && word[4]) {
+         fd = open(word + 4, O_RDONLY);
+         if (fd < 0 || fstat(fd, &st)) {
+            fprintf(stderr, "Unable to open file '%s'\n", word + 4);
+            exit(1);
+         }
+         req->payload_size = (size_t)st.st_size;
+         req->payload = (unsigned char *)malloc(req->payload_size ? req->payload_size : 1);
+         if (!req->payload || pread_full(fd, req->payload, req->payload_size, 0)) {
+            fprintf(stderr, "Error loading image '%s'\n", word + 4);
+            exit(1);
+         }
+         close(fd);
+         fprintf(fp, "in=@%lu", (unsigned long)req->payload_size);
+      }
+      else if (strncmp(word, "out=@", 5) == 0 && word[5]) {
+         req->save = word + 5;
+         fprintf(fp, "out=@");
+      }
+      else if (strncmp(word, "in=mem:", 7) == 0) {
+         // The raster goes into a memfd the client owns, the server maps it
+         source = readPPM(word + 7);
+         in_fd = memfd_create("imgResample-in", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+         if (in_fd < 0 || ftruncate(in_fd, (off_t)image_size(source))) {
+            perror("memfd");
+            exit(1);
+         }
+         map = mmap(NULL, image_size(source), PROT_WRITE, MAP_SHARED, in_fd, 0);
+         if (map == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+         }
+         memcpy(map, source->data, image_size(source));
+         munmap(map, image_size(source));
 
-   // pixel data - binary 
-   fwrite(img->data, 3 * img->x, img->y, fp);
+         // Sealed once the writable mapping is gone, the server checks for it
+         if (fcntl(in_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+            perror("memfd seal");
+            exit(1);
+         }
+         fprintf(fp, "in=fd width=%d height=%d channels=%d maxval=%d",
+                 source->x, source->y, source->channels, source->maxval);
+      }
+      else if (strncmp(word, "out=mem:", 8) == 0) {
+         shared_save = word + 8;
+         fprintf(fp, "out=fd");
+      }
+      else {
+         fputs(word, fp);
+      }
+   }
    fclose(fp);
-}
 
+   if (shared_save) {
+      if (!source || !factor) {
+         fprintf(stderr, "out=mem needs scale and in=mem\n");
+         exit(1);
+      }
+      req->shared = *source;
+      req->shared.x = (int)factor_size(factor, atof(factor), source->x);
+      req->shared.y = (int)factor_size(factor, atof(factor), source->y);
+      req->shared.stride = 0;
+      if (gray) { req->shared.channels = 1; }
+      req->shared_size = image_size(&req->shared);
+      out_fd = memfd_create("imgResample-out", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      if (out_fd < 0 || ftruncate(out_fd, (off_t)(req->shared_size ? req->shared_size : 1)) ||
+          fcntl(out_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) {
+         perror("memfd");
+         exit(1);
+      }
+      map = mmap(NULL, req->shared_size ? req->shared_size : 1, PROT_READ, MAP_SHARED, out_fd, 0);
+      if (map == MAP_FAILED) {
+         perror("mmap");
+         exit(1);
+      }
+      req->shared.data = (unsigned char *)map;
+      req->shared_save = shared_save;
+   }
+   free_image(source);
 
-/*---------------------------------------------------------------------------
-  
-  
-----------------------------------------------------------------------------*/
-double cubic_hermite(double A, double B, double C, double D, double t) {
+   // The server takes the input descriptor first
+   if (in_fd >= 0) { req->fds[req->nfds++] = in_fd; }
+   if (out_fd >= 0) { req->fds[req->nfds++] = out_fd; }
+}
 
-   double a = -A / 2.0f + (3.0f*B) / 2.0f - (3.0f*C) / 2.0f + D / 2.0f;
-   double b = A - (5.0f*B) / 2.0f + 2.0f*C - D / 2.0f;
-   double c = -A / 2.0f + C / 2.0f;
-   double d = B;
+static void free_client_request(ClientRequest *req) {
+   int i;
 
-   return a*t*t*t + b*t*t + c*t + d;
+   free(req->line);
+   free(req->payload);
+   for (i = 0; i < req->nfds; i++) {
+      close(req->fds[i]);
+   }
+   if (req->shared.data) {
+      munmap(req->shared.data, req->shared_size ? req->shared_size : 1);
+   }
 }
 
 /*---------------------------------------------------------------------------
-  This functio returns a rgb byte array for the data at the given point x,y*
-  BUT will never exceed the array bounds so it handles the edge effect.
+   This function sends one request and reads the reply.  The line goes out
+   with sendmsg so the request's descriptors travel with it.
+   
+      FILE *in, *out                - Connection streams
+      const ClientRequest *req      - Request to send
+      unsigned char **reply         - Returned malloced reply image, or NULL
+      size_t *reply_size            - Returned reply image size
+      char *status                  - Returned status line
+      size_t status_size            - Size of the status buffer
   
-      PPMImage *source_image  - Pointer to an images
-      int x, int y            - Image x,y coordinates
-      uint8_t temp[]          - Pointer to 3 byte array to return data
-
-   return: nothing
+   Returns: int  0 for an OK reply, -1 otherwise
    
-   Error handling: none
+   Error Handling:   returns an error code
 ----------------------------------------------------------------------------*/
-void get_pixel_clamped(PPMImage *source_image, int x, int y, uint8_t temp[])  {
+static int client_exchange(FILE *in, FILE *out, const ClientRequest *req,
+                           unsigned char **reply, size_t *reply_size,
+                           char *status, size_t status_size) {
+   union {
+      struct cmsghdr align;
+      char space[CMSG_SPACE(2 * sizeof(int))];
+   } control;
+   size_t len = strlen(req->line) + 1, sent = 0;
+   struct cmsghdr *cmsg;
+   struct msghdr msg;
+   struct iovec iov;
+   char *text;
+   ssize_t got;
 
-   // Keep from exceeding the array index
-   CLAMP(x, 0, source_image->x - 1);
-   CLAMP(y, 0, source_image->y - 1);
-   
-   temp[0] = source_image->data[x+(source_image->x*y)].red;
-   temp[1] = source_image->data[x+(source_image->x*y)].green;
-   temp[2] = source_image->data[x+(source_image->x*y)].blue;
+   *reply = NULL;
+   *reply_size = 0;
+
+   text = (char *)malloc(len);
+   if (!text) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   memcpy(text, req->line, len - 1);
+   text[len - 1] = '\n';
+
+   // The descriptors ride on the first piece of the line
+   while (sent < len) {
+      memset(&msg, 0, sizeof(msg));
+      iov.iov_base = text + sent;
+      iov.iov_len = len - sent;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      if (sent == 0 && req->nfds) {
+         memset(&control, 0, sizeof(control));
+         msg.msg_control = control.space;
+         msg.msg_controllen = CMSG_SPACE(req->nfds * sizeof(int));
+         cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg->cmsg_level = SOL_SOCKET;
+         cmsg->cmsg_type = SCM_RIGHTS;
+         cmsg->cmsg_len = CMSG_LEN(req->nfds * sizeof(int));
+         memcpy(CMSG_DATA(cmsg), req->fds, req->nfds * sizeof(int));
+      }
+      got = sendmsg(fileno(out), &msg, 0);
+      if (got < 0 && errno == EINTR) { continue; }
+      if (got <= 0) { break; }
+      sent += (size_t)got;
+   }
+   free(text);
+
+   if (sent < len) {
+      snprintf(status, status_size, "ERR Lost connection");
+      return(-1);
+   }
+   if (req->payload) { fwrite(req->payload, 1, req->payload_size, out); }
+   if (fflush(out) || !fgets(status, status_size, in)) {
+      snprintf(status, status_size, "ERR Lost connection");
+      return(-1);
+   }
+   status[strcspn(status, "\r\n")] = '\0';
+   if (strncmp(status, "OK ", 3)) { return(-1); }
+
+   *reply_size = (size_t)strtoull(status + 3, NULL, 10);
+   *reply = (unsigned char *)malloc(*reply_size ? *reply_size : 1);
+   if (!*reply) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
+   if (fread(*reply, 1, *reply_size, in) != *reply_size) {
+      snprintf(status, status_size, "ERR Lost connection");
+      return(-1);
+   }
+   return(0);
 }
 
 /*---------------------------------------------------------------------------
+   This function sends one request to a server, eg
+      --client /tmp/resample.sock scale=0.5 in=@in.ppm out=@out.ppm
+   
+      const char *path  - Socket file name
+      int count         - Number of request words
+      char *words[]     - Request words, see client_request_line
   
-
-   return: nothing
+   Returns: int  0 for an OK reply, 1 otherwise
    
-   Error handling: none
+   Error Handling:   exits if the server can't be reached
 ----------------------------------------------------------------------------*/
-void sample_bicubic(PPMImage *source_image, double u, double v, uint8_t sample[]) {
+static int run_client(const char *path, int count, char *words[]) {
+   char status[BATCH_LINE_SIZE];
+   unsigned char *reply;
+   size_t reply_size;
+   ClientRequest req;
+   FILE *in, *out, *fp;
+   int fd, rc;
 
-   double x = (u * source_image->x)-0.5;
-   int xint = (int)x;
-   double xfract = x-floor(x);
+   signal(SIGPIPE, SIG_IGN);
+   fd = connect_socket(path);
+   if (fd < 0) {
+      fprintf(stderr, "Unable to connect to '%s'\n", path);
+      exit(1);
+   }
+   in = fdopen(fd, "r");
+   out = fdopen(dup(fd), "w");
+   if (!in || !out) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
 
-   double y = (v * source_image->y) - 0.5;
-   int yint = (int)y;
-   double yfract = y - floor(y);
-   
-   int i;
+   client_request_line(count, words, &req);
+   rc = client_exchange(in, out, &req, &reply, &reply_size, status, sizeof(status));
+   printf("%s\n", status);
+   if (rc == 0 && req.save) {
+      fp = fopen(req.save, "wb");
+      if (!fp || fwrite(reply, 1, reply_size, fp) != reply_size || fclose(fp)) {
+         fprintf(stderr, "Unable to write file '%s'\n", req.save);
+         exit(1);
+      }
+   }
+   if (rc == 0 && req.shared_save) {
+      writePPM(req.shared_save, &req.shared);
+   }
+
+   free_client_request(&req);
+   free(reply);
+   fclose(in);
+   fclose(out);
+   return(rc ? 1 : 0);
+}
 
-   uint8_t p00[3], p10[3], p20[3], p30[3];
-   uint8_t p01[3], p11[3], p21[3], p31[3];
-   uint8_t p02[3], p12[3], p22[3], p32[3];
-   uint8_t p03[3], p13[3], p23[3], p33[3];
+/*---------------------------------------------------------------------------
+   This is a load generator thread.  It opens its own connection and sends
+   requests until the shared count is used up, timing each one.
    
-   // 1st row
-   get_pixel_clamped(source_image, xint - 1, yint - 1, p00);   
-   get_pixel_clamped(source_image, xint + 0, yint - 1, p10);
-   get_pixel_clamped(source_image, xint + 1, yint - 1, p20);
-   get_pixel_clamped(source_image, xint + 2, yint - 1, p30);
+      void *arg   - Pointer to the LoadGen
+  
+   Returns: NULL
    
-   // 2nd row
-   get_pixel_clamped(source_image, xint - 1, yint + 0, p01);
-   get_pixel_clamped(source_image, xint + 0, yint + 0, p11);
-   get_pixel_clamped(source_image, xint + 1, yint + 0, p21);
-   get_pixel_clamped(source_image, xint + 2, yint + 0, p31);
+   Error Handling:   failures are counted
+----------------------------------------------------------------------------*/
+static void *loadgen_thread(void *arg) {
+   LoadGen *gen = (LoadGen *)arg;
+   char status[BATCH_LINE_SIZE];
+   struct timespec start, stop;
+   unsigned char *reply;
+   size_t reply_size;
+   FILE *in = NULL, *out = NULL;
+   int fd, i, rc;
 
-   // 3rd row
-   get_pixel_clamped(source_image, xint - 1, yint + 1, p02);
-   get_pixel_clamped(source_image, xint + 0, yint + 1, p12);
-   get_pixel_clamped(source_image, xint + 1, yint + 1, p22);
-   get_pixel_clamped(source_image, xint + 2, yint + 1, p32);
+   fd = connect_socket(gen->socket_path);
+   if (fd >= 0) {
+      in = fdopen(fd, "r");
+      out = fdopen(dup(fd), "w");
+   }
 
-   // 4th row
-   get_pixel_clamped(source_image, xint - 1, yint + 2, p03);
-   get_pixel_clamped(source_image, xint + 0, yint + 2, p13);
-   get_pixel_clamped(source_image, xint + 1, yint + 2, p23);
-   get_pixel_clamped(source_image, xint + 2, yint + 2, p33);
-   
-   // interpolate bi-cubically!
-   for (i = 0; i < 3; i++) {
-      double col0 = cubic_hermite(p00[i], p10[i], p20[i], p30[i], xfract);
-      double col1 = cubic_hermite(p01[i], p11[i], p21[i], p31[i], xfract);
-      double col2 = cubic_hermite(p02[i], p12[i], p22[i], p32[i], xfract);
-      double col3 = cubic_hermite(p03[i], p13[i], p23[i], p33[i], xfract);
-  
-      double value = cubic_hermite(col0, col1, col2, col3, yfract);
-  
-      CLAMP(value, 0.0f, 255.0f);
-  
-      sample[i] = (uint8_t)value;
-       
+   while ((i = atomic_fetch_add(&gen->next, 1)) < gen->count) {
+      rc = -1;
+      if (in && out) {
+         clock_gettime(CLOCK_MONOTONIC, &start);
+         rc = client_exchange(in, out, gen->req, &reply, &reply_size, status, sizeof(status));
+         clock_gettime(CLOCK_MONOTONIC, &stop);
+         free(reply);
+         gen->latency[i] = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+      }
+      if (rc) {
+         pthread_mutex_lock(&gen->lock);
+         gen->failed++;
+         pthread_mutex_unlock(&gen->lock);
+         gen->latency[i] = -1.0;
+      }
    }
-   if (debug) { printf("sample[]=%d %d %d\n", sample[0], sample[1], sample[2]); }
+
+   if (in) { fclose(in); } else if (fd >= 0) { close(fd); }
+   if (out) { fclose(out); }
+   return(NULL);
 }
 
+static int compare_double(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return((x > y) - (x < y));
+}
 
 /*---------------------------------------------------------------------------
-   This function resizes an input image to create a new destination image.
-   
-         PPMImage *source_image        - Input image to resize_image
-         PPMImage *destination_image   - defined output images
-         double scale                  - resize value
+   This function sends the same request many times over several
+   connections and prints the throughput and latency percentiles, eg
+      --loadgen /tmp/resample.sock 1000 8 scale=0.5 in=@in.ppm out=@
    
-   returns: nothing
+      const char *path  - Socket file name
+      int requests      - Number of requests to send
+      int connections   - Number of connections sending at once
+      int count         - Number of request words
+      char *words[]     - Request words, see client_request_line
+  
+   Returns: int  0 if every request succeeded, 1 otherwise
    
-   error handling: none
+   Error Handling:   exits if memory runs out
 ----------------------------------------------------------------------------*/
-void resize_image(PPMImage *source_image, PPMImage *destination_image, double scale) {
-   uint8_t sample[3];
-   int y, x;
-
-   destination_image->x = (long)((double)(source_image->x)*scale);
-   destination_image->y = (long)((double)(source_image->y)*scale);
+static int run_loadgen(const char *path, int requests, int connections, int count, char *words[]) {
+   struct timespec start, stop;
+   ClientRequest req;
+   pthread_t *thread;
+   double elapsed;
+   LoadGen gen;
+   int i, n;
 
-   printf("Source x-width=%d | y-width=%d\n",source_image->x, source_image->y);
-   printf("Dest   x-width=%d | y-width=%d\n",destination_image->x, destination_image->y);
-    
-   for (y = 0; y < destination_image->y; y++) {
+   signal(SIGPIPE, SIG_IGN);
+   client_request_line(count, words, &req);
+   memset(&gen, 0, sizeof(gen));
+   gen.socket_path = path;
+   gen.req = &req;
+   gen.count = requests;
+   atomic_init(&gen.next, 0);
+   pthread_mutex_init(&gen.lock, NULL);
+   gen.latency = (double *)calloc(requests, sizeof(double));
+   thread = (pthread_t *)calloc(connections, sizeof(pthread_t));
+   if (!gen.latency || !thread) {
+      fprintf(stderr, "Unable to allocate memory\n");
+      exit(1);
+   }
 
-      double v = (double)y / (double)(destination_image->y - 1);
-      
-      for (x = 0; x < destination_image->x; ++x) {
-   
-         double u = (double)x / (double)(destination_image->x - 1);
-         if (debug) {printf("v=%f  u=%f\n",v, u);}
-         sample_bicubic(source_image, u, v, sample);
-   
-         if (debug) {printf("x,y %d,%d offset %d\n", x,y, x+((destination_image->x)*y));}
-          
-         destination_image->data[x+((destination_image->x)*y)].red 	= sample[0];
-         destination_image->data[x+((destination_image->x)*y)].green	= sample[1];  
-         destination_image->data[x+((destination_image->x)*y)].blue 	= sample[2];  
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i = 0; i < connections; i++) {
+      if (pthread_create(&thread[i], NULL, loadgen_thread, &gen)) {
+         fprintf(stderr, "Unable to start thread\n");
+         exit(1);
       }
    }
+   for (i = 0; i < connections; i++) {
+      pthread_join(thread[i], NULL);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &stop);
+   elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+
+   // Percentiles by nearest rank over the requests that succeeded
+   for (i = n = 0; i < requests; i++) {
+      if (gen.latency[i] >= 0.0) { gen.latency[n++] = gen.latency[i]; }
+   }
+   qsort(gen.latency, n, sizeof(double), compare_double);
+   printf("%d requests, %d failed, %d connections, %.3f s, %.1f requests/s\n",
+          requests, gen.failed, connections, elapsed, n / elapsed);
+   if (n) {
+      printf("latency ms  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+             gen.latency[(int)ceil(0.50 * n) - 1] * 1e3, gen.latency[(int)ceil(0.90 * n) - 1] * 1e3,
+             gen.latency[(int)ceil(0.99 * n) - 1] * 1e3, gen.latency[n - 1] * 1e3);
+   }
+
+   pthread_mutex_destroy(&gen.lock);
+   free_client_request(&req);
+   free(gen.latency);
+   free(thread);
+   return(gen.failed ? 1 : 0);
 }
 
 
@@ -347,52 +5922,392 @@ void resize_image(PPMImage *source_image, PPMImage *destination_image, double sc
   
 ----------------------------------------------------------------------------*/
 int main(int argc, char *argv[]) {
+   ResampleOptions options = { 0 };
+   const char *batch = NULL, *serve = NULL, *client = NULL, *loadgen = NULL, *stats_file = NULL;
+   const char *baseline = NULL, *update = NULL;
+   ImageRect *changed = NULL;
+   int changes = 0;
+   double min_psnr = 0.0, tolerance = DEFAULT_BENCH_TOLERANCE;
+   uint64_t memory_limit = 0;
+   StageMark run;
+   int requests = 0, connections = 0, bench = 0;
+   long threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int arg = 1, status;
+
+   // Options come before the factor
+   while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+      if (strcmp(argv[arg], "--ascii") == 0) { ascii_output = 1; }
+      else if (strcmp(argv[arg], "--linear") == 0) { options.linear = 1; }
+      else if (strcmp(argv[arg], "--engine") == 0 && arg + 1 < argc) {
+         if (parse_engine(argv[++arg], &options)) {
+            printf("error engine must be float or double\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--affine") == 0 && arg + 1 < argc) {
+         if (parse_affine(argv[++arg], &options)) {
+            printf("error affine must be six numbers a,b,c,d,e,f\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--rotate") == 0 && arg + 1 < argc) {
+         if (parse_rotate(argv[++arg], &options)) {
+            printf("error rotate must be an angle in degrees\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--fill") == 0 && arg + 1 < argc) {
+         options.fill = atoi(argv[++arg]);
+         if (options.fill < 0 || options.fill > MAX_COMPONENT_COLOR) {
+            printf("error fill must be a sample value 0 to %d\n", MAX_COMPONENT_COLOR);
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+         if (parse_output(argv[++arg], &options)) {
+            printf("error output must be rgb, gray or ycbcr420\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--sharpen") == 0 && arg + 1 < argc) {
+         if (parse_sharpen(argv[++arg], &options)) {
+            printf("error sharpen must be amount[,radius[,threshold]], radius up to %g\n", MAX_SHARPEN_RADIUS);
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--align") == 0 && arg + 1 < argc) {
+         if (parse_align(argv[++arg], &options)) {
+            printf("error align must be center or corner\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--tile") == 0 && arg + 1 < argc) {
+         if (parse_tile(argv[++arg], &options)) {
+            printf("error tile size must be off, auto or WxH\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+         threads = atol(argv[++arg]);
+         if (threads < 1 || threads > MAX_THREADS) { printf("error threads must be 1 to %d\n", MAX_THREADS); return(99); }
+      }
+      else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) { batch = argv[++arg]; }
+      else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) { serve = argv[++arg]; }
+      else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+         output_cache.dir = argv[++arg];
+         if (mkdir(output_cache.dir, 0777) && errno != EEXIST) {
+            perror(output_cache.dir);
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--stats") == 0 && arg + 1 < argc) { stats_file = argv[++arg]; }
+      else if (strcmp(argv[arg], "--memory-limit") == 0 && arg + 1 < argc) {
+         memory_limit = parse_size(argv[++arg]);
+         if (memory_limit == 0) { printf("error memory limit must be a size like 512M\n"); return(99); }
+      }
+      else if (strcmp(argv[arg], "--cache-size") == 0 && arg + 1 < argc) {
+         output_cache.limit = parse_size(argv[++arg]);
+         if (output_cache.limit == 0) { printf("error cache size must be a size like 512M\n"); return(99); }
+      }
+      else if (strcmp(argv[arg], "--client") == 0 && arg + 1 < argc) { client = argv[++arg]; }
+      else if (strcmp(argv[arg], "--loadgen") == 0 && arg + 3 < argc) {
+         loadgen = argv[++arg];
+         requests = atoi(argv[++arg]);
+         connections = atoi(argv[++arg]);
+         if (requests < 1 || connections < 1 || connections > MAX_THREADS) {
+            printf("error loadgen needs a request count and 1 to %d connections\n", MAX_THREADS);
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--psnr") == 0 && arg + 1 < argc) {
+         min_psnr = atof(argv[++arg]);
+         if (min_psnr <= 0.0) { printf("error psnr must be a positive number of dB\n"); return(99); }
+      }
+      else if (strcmp(argv[arg], "--compare") == 0 && arg + 2 < argc) {
+         return(run_compare(argv[arg + 1], argv[arg + 2], min_psnr));
+      }
+      else if (strcmp(argv[arg], "--bench") == 0 && arg + 1 < argc) {
+         bench = atoi(argv[++arg]);
+         if (bench < 1) { printf("error bench needs a run count\n"); return(99); }
+      }
+      else if (strcmp(argv[arg], "--generate") == 0 && arg + 4 < argc) {
+         return(run_generate(argv[arg + 1], argv[arg + 2], atoi(argv[arg + 3]), argv[arg + 4]));
+      }
+      else if (strcmp(argv[arg], "--baseline") == 0 && arg + 1 < argc) { baseline = argv[++arg]; }
+      else if (strcmp(argv[arg], "--update") == 0 && arg + 2 < argc) {
+         update = argv[++arg];
+         free(changed);
+         if (parse_changed(argv[++arg], &changed, &changes)) {
+            printf("error changed rectangles must be x,y,w,h[:x,y,w,h...]\n");
+            return(99);
+         }
+      }
+      else if (strcmp(argv[arg], "--tolerance") == 0 && arg + 1 < argc) {
+         tolerance = atof(argv[++arg]);
+         if (tolerance <= 0.0 || tolerance >= 100.0) { printf("error tolerance must be 0 to 100 percent\n"); return(99); }
+      }
+      else { printf("Unknown option %s\n", argv[arg]); return(99); }
+      arg++;
+   }
+
+   // The client and load generator only talk to a server
+   if (client && argc > arg) {
+      return(run_client(client, argc - arg, argv + arg));
+   }
+   if (loadgen && argc > arg) {
+      return(run_loadgen(loadgen, requests, connections, argc - arg, argv + arg));
+   }
+
+   // One scan finds the size of the cache, stores keep it up to date
+   if (output_cache.dir) {
+      cache_evict();
+   }
+
+   // Counters are opened by this thread and by each worker as it starts
+   if (stats_file) {
+      stats.enabled = 1;
+      stats_open_counters();
+      stats_begin(&run);
+   }
+
+   // A pool is only worth starting with more than one core
+   if (threads > 1) {
+      scheduler = init_scheduler((int)threads);
+   }
+
+   if (serve && argc == arg) {
+      status = run_server(serve, &options);
+      free_scheduler(scheduler);
+      finish_stats(stats_file, &run);
+      return(status);
+   }
+
+   if (batch && argc == arg) {
+      status = run_batch(batch, &options);
+      print_cache_stats();
+      free_scheduler(scheduler);
+      finish_stats(stats_file, &run);
+      return(status);
+   }
+
    // Help
-   if (argc != 4) {
-      printf("This program resamples PPM images up or down using cubic resampling\n");
-      printf("or a quick 2x down sample\n");
-      printf("Syntax is  %s factor infile  outfile\n", argv[0]);
-      printf("    factor - '2x' or a floating point number\n");
+   if (argc - arg != 3) {
+      printf("This program resamples PPM/PGM/PBM images up or down using cubic resampling\n");
+      printf("or a quick 2x down sample or 2x and 4x up sample\n");
+      printf("Syntax is  %s [options] factor infile  outfile\n", argv[0]);
+      printf("    factor - '2x', '2up', '4up' or a floating point number\n");
+      printf("  options:\n");
+      printf("    --ascii  write plain (P2/P3) output, images with alpha stay PAM\n");
+      printf("    --linear interpolate in linear light rather than on sRGB values\n");
+      printf("    --align center|corner  map pixel areas edge to edge, the default, or put the\n");
+      printf("                  first and last pixel centers of source and destination together\n");
+      printf("    --tile off|auto|WxH  destination tile size, auto fits tiles to the L2 cache,\n");
+      printf("                  off resamples one pixel at a time in double precision\n");
+      printf("    --engine float|double  arithmetic of the tiled engine, float is the default\n");
+      printf("                  and is within one step of double\n");
+      printf("    --sharpen amount[,radius[,threshold]]  unsharp mask the output as it is\n");
+      printf("                  resampled, radius is the blur sigma in output pixels, default %g,\n", DEFAULT_SHARPEN_RADIUS);
+      printf("                  differences under threshold sample steps are left, default 0,\n");
+      printf("                  needs the tiled float engine\n");
+      printf("    --output rgb|gray|ycbcr420  convert the output as it is stored, gray writes\n");
+      printf("                  the BT.601 luma as a PGM, ycbcr420 writes a raw yuv420p file of\n");
+      printf("                  the luma and the Cb and Cr planes resampled at half size,\n");
+      printf("                  16 bit samples little endian, neither works with quick factors\n");
+      printf("    --rotate degrees  rotate counterclockwise about the center while resampling,\n");
+      printf("                  the factor still sets the output size\n");
+      printf("    --affine a,b,c,d,e,f  warp by a matrix taking the center of output pixel x,y\n");
+      printf("                  to source position a*(x+.5)+b*(y+.5)+c, d*(x+.5)+e*(y+.5)+f\n");
+      printf("                  in source pixels, the factor sets the output size\n");
+      printf("    --fill N  color sample value where a warp leaves the source, default 0,\n");
+      printf("                  images with alpha are clear there\n");
+      printf("    --update previous x,y,w,h[:x,y,w,h...]  redo only the pixels of previous, the\n");
+      printf("                  output of the same factor and options, that read the changed\n");
+      printf("                  rectangles of infile, and write it to outfile, which can be\n");
+      printf("                  previous, not for ycbcr420 or quick factors, skips the cache\n");
+      printf("    --threads N  worker threads, defaults to the number of cores\n");
+      printf("    --batch file  resample each 'factor infile outfile' line of file,\n");
+      printf("                  replaces the factor and file arguments, an image like the one\n");
+      printf("                  before it, a frame of a video, only redoes the blocks that changed\n");
+      printf("    --cache dir  keep outputs in dir keyed by the input pixels and factor, and\n");
+      printf("                  reuse them instead of resampling again\n");
+      printf("    --cache-size N  bytes kept in the cache, eg 512M, oldest used go first, default 1G\n");
+      printf("    --memory-limit N  bytes the image may take, eg 2G, a larger one is read and\n");
+      printf("                  written in strips of rows, binary images and rgb or gray\n");
+      printf("                  output only, strips skip the cache and --bench\n");
+      printf("    --stats file  write per stage times, bytes, pixels and hardware counters\n");
+      printf("                  as JSON to file, - for stdout\n");
+      printf("    --serve socket  serve requests on a Unix domain socket until a shutdown request,\n");
+      printf("                  in= and out= files are opened as the server user, so any client\n");
+      printf("                  can read or overwrite what that user can, the socket is made\n");
+      printf("                  0600 to keep other users out\n");
+      printf("    --client socket word...  send one request, eg scale=0.5 in=@in.ppm out=@out.ppm,\n");
+      printf("                  @ sends or receives the image over the socket, else files are\n");
+      printf("                  named for the server, other words are linear=1 tile=WxH ascii=1\n");
+      printf("                  align=corner engine=double sharpen=0.5,1 output=gray\n");
+      printf("                  rotate=1.5 affine=a,b,c,d,e,f fill=255,\n");
+      printf("                  scale=2x, 2up or 4up for the quick kernels, and ping, stats\n");
+      printf("                  or shutdown alone.\n");
+      printf("                  in=mem:FILE and out=mem:FILE pass memfd rasters the server maps\n");
+      printf("                  rather than copying the image through the socket, the server\n");
+      printf("                  takes memfds sealed against shrinking, and writes for input\n");
+      printf("    --loadgen socket N C word...  send a request N times over C connections\n");
+      printf("                  and print throughput and latency percentiles\n");
+      printf("    --compare golden test  check test matches golden exactly, with --psnr DB\n");
+      printf("                  before it a PSNR of at least DB passes, exits 1 on failure\n");
+      printf("    --bench N  time N resamples and N reads of the input and print the median\n");
+      printf("                  throughputs\n");
+      printf("    --baseline file  with --bench, record the throughputs in file or fail if one\n");
+      printf("                  is slower than the recorded one by more than --tolerance percent,\n");
+      printf("                  default %d\n", DEFAULT_BENCH_TOLERANCE);
+      printf("    --generate pattern WxH C file  write a synthetic image to file for benchmarks,\n");
+      printf("                  pattern is gradient, noise, checker or text, C is 1 for P5\n");
+      printf("                  or 3 for P6, up to %ld a side, rows are streamed so any\n", PPM_MAX_DIMENSION);
+      printf("                  size that fits on disk can be made\n");
       printf("  eg  %s  0.5  in.ppm  out.ppm\n", argv[0]);
       printf("      %s  2x   in.ppm  out.ppm\n", argv[0]);
       return(99);
    }
+   argv += arg - 1;     // Shift so argv[1..3] are the factor and file names
    
    double scale = atof(argv[1]); 
    PPMImage *source_image;
-   PPMImage *destination_image;
+   PPMImage *destination_image, *chroma_image;
    printf("Starting...\n\n");
    
-   if (strcmp(argv[1], "2x") && (scale <= 0.0)) { printf("error scale must be positive\n"); return(99);}
+   if (!is_quick(argv[1]) && (scale <= 0.0)) { printf("error scale must be positive\n"); return(99);}
+   
+   if (option_conflict(argv[1], &options)) { printf("error %s\n", option_conflict(argv[1], &options)); return(99); }
+   if (update && (is_quick(argv[1]) || options.output == OUTPUT_YCBCR420)) {
+      printf("error update needs a scale and rgb or gray output\n");
+      return(99);
+   }
+   
+   if (memory_limit && (update || is_quick(argv[1]) || options.output == OUTPUT_YCBCR420 || ascii_output)) {
+      printf("error memory limit needs a scale, binary rgb or gray output and no update\n");
+      return(99);
+   }
    
-   if(remove(argv[3]) == 0) {	printf("Deleting old image %s...\n\n", argv[3]);}
+   // An update may write over its previous output
+   if (!update && remove(argv[3]) == 0) {	printf("Deleting old image %s...\n\n", argv[3]);}
+
+   // An image larger than the memory limit is resampled in strips
+   if (memory_limit) {
+      status = run_strips(argv[2], argv[1], scale, &options, memory_limit, argv[3]);
+      if (status >= 0) {
+         free_scheduler(scheduler);
+         finish_stats(stats_file, &run);
+         return(status);
+      }
+   }
 
     source_image = readPPM(argv[2]);
-    if (debug) {printf("Infile x,y %dx%d\n", source_image->x, source_image->y);}
+    if (!output_fits(argv[1], scale, source_image)) {
+       printf("error output size out of range\n");
+       return(99);
+    }
+    TRACE_PRINTF("Infile x,y %dx%d\n", source_image->x, source_image->y);
     
+   if (update) {
+      status = run_update(source_image, scale, &options, update, changed, changes, argv[3]);
+      free_image(source_image);
+      free(changed);
+      free_scheduler(scheduler);
+      finish_stats(stats_file, &run);
+      return(status);
+   }
+   
    // Check for quick 
    if (strcmp(argv[1], "2x") == 0) {
       printf("Using quick 2X downsample\n");
-      destination_image = resize2(source_image);
    }
-   else {
-    destination_image = init_destination_image(source_image, scale);
-    resize_image(source_image, destination_image, scale);
+   else if (quick_up(argv[1])) {
+      printf("Using quick %dX upsample\n", quick_up(argv[1]));
    }
+   destination_image = resample_output(source_image, argv[1], scale, &options, &chroma_image);
    
-    writePPM(argv[3], destination_image);
+    write_output(argv[3], destination_image, chroma_image);
+    print_cache_stats();
+    
+    status = 0;
+    if (bench) {
+       status = run_bench(source_image, argv[1], scale, &options, bench, argv[2], baseline, tolerance);
+    }
     
     // return memory
-    free(source_image->data);
-    free(source_image);
+    free_image(source_image);
     source_image = NULL;
     
-    free(destination_image->data);
-    free(destination_image);
+    free_image(destination_image);
     destination_image = NULL;
+    free_image(chroma_image);
+    chroma_image = NULL;
     
+    free_scheduler(scheduler);
+    finish_stats(stats_file, &run);
     
-   return(0);
+   return(status);
+}
+
+/*---------------------------------------------------------------------------
+   This is a quick function to resizes an input image down by 2, averaging
+   each 2x2 block one channel at a time, with color weighted by alpha
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - Sized output image
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   returns:  nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void resize2_n(PPMImage *source_image, PPMImage *destination_image, 
+                             const int channels, const int wide) {
+   const size_t pixel = (size_t)channels << wide;
+   int x, y, i, k;
+   
+   for (y = 0; y < destination_image->y; y++) {
+      const unsigned char *top = image_row(source_image, 2*y);
+      const unsigned char *bottom = image_row(source_image, 2*y + 1);
+      unsigned char *out = image_row(destination_image, y);
+
+      for (x = 0; x < destination_image->x; x++) {
+         // The 2x2 block, top left, top right, bottom left, bottom right
+         const unsigned char *block[4];
+         unsigned int value[MAX_CHANNELS];
+
+         block[0] = top + 2*x*pixel;
+         block[1] = block[0] + pixel;
+         block[2] = bottom + 2*x*pixel;
+         block[3] = block[2] + pixel;
+
+         for (i = 0; i < channels; i++) {
+            value[i] = 0;
+            for (k = 0; k < 4; k++) {
+               value[i] += wide ? ((const uint16_t *)block[k])[i] : block[k][i];
+            }
+         }
+
+         // With alpha the color is averaged weighted by each pixel's alpha
+         if (HAS_ALPHA(channels)) {
+            unsigned int alpha = value[channels - 1];
+
+            for (i = 0; i < channels - 1; i++) {
+               uint64_t weighted = 0;
+
+               for (k = 0; k < 4; k++) {
+                  weighted += wide ? (uint64_t)((const uint16_t *)block[k])[i] * ((const uint16_t *)block[k])[channels - 1]
+                                   : (uint64_t)block[k][i] * block[k][channels - 1];
+               }
+               value[i] = alpha ? (unsigned int)(weighted / alpha) * 4 : 0;
+            }
+         }
+
+         for (i = 0; i < channels; i++) {
+            if (wide) { ((uint16_t *)out)[x*channels + i] = value[i]/4; }
+            else      { out[x*channels + i] = value[i]/4; }
+         }
+      } // End y
+   } // End x
 }
 
 /*---------------------------------------------------------------------------
@@ -405,37 +6320,264 @@ int main(int argc, char *argv[]) {
 ----------------------------------------------------------------------------*/
 PPMImage *resize2(PPMImage *source_image) {
    PPMImage *destination_image;
+   StageMark mark;
    
-   destination_image = init_destination_image(source_image, 0.5);
+   stats_begin(&mark);
+   destination_image = init_destination_image(source_image, 0.5, OUTPUT_RGB);
 
    // fix up the size to make it always smaller
    destination_image->x = (source_image->x/2); 
    destination_image->y = (source_image->y/2); 
    
-   int x,y;
+   resize2_into(source_image, destination_image);
+   stats_end(STAGE_RESAMPLE, &mark, 0, (uint64_t)destination_image->x * destination_image->y);
+   
+   return(destination_image);
+}
+
+/*---------------------------------------------------------------------------
+   This function runs the quick 2x down sample into an existing image
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - Output image, half the source size
+   returns:  nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+void resize2_into(PPMImage *source_image, PPMImage *destination_image) {
+   DISPATCH_FORMAT(source_image, resize2_n, source_image, destination_image);
+}
+
+/*---------------------------------------------------------------------------
+   These are the fixed Catmull-Rom weights of the quick up samples, in
+   units of 1/1024 (UP_WEIGHT_BITS).  Destination pixel f*k + p is centered at source
+   position k + (p + 0.5)/f - 0.5, so each of the f phases always uses the
+   same four weights on source pixels k + up_offset[p] - 1 to + 2.
+----------------------------------------------------------------------------*/
+static const int up2_weights[2][4] = {
+   { -24, 232, 888, -72 },          // t = 0.75
+   { -72, 888, 232, -24 }           // t = 0.25
+};
+static const int up2_offset[2] = { -1, 0 };
+
+static const int up4_weights[4][4] = {
+   { -45, 399, 745, -75 },          // t = 0.625
+   {  -7,  93, 987, -49 },          // t = 0.875
+   { -49, 987,  93,  -7 },          // t = 0.125
+   { -75, 745, 399, -45 }           // t = 0.375
+};
+static const int up4_offset[4] = { -1, -1, 0, 0 };
+
+/*---------------------------------------------------------------------------
+   This function filters one source row horizontally for the quick up
+   sample.  The row is first copied with two clamped pixels of padding on
+   each side, color premultiplied by alpha.  The result is kept one plane
+   per phase, plane p holding destination pixels f*k + p, so every loop
+   runs over contiguous samples with constant weights and vectorizes.
+   
+         PPMImage *source_image  - Input image
+         int sy                  - Source row, clamped to the image
+         int32_t *pad            - Scratch of (source width + 4) pixels
+         int32_t *out            - Returned planes, factor * source width pixels
+         const int factor        - 2 or 4
+         const int channels      - Samples per pixel
+         const int wide          - Set for 16 bit samples
+   returns:  nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void up_row_n(PPMImage *source_image, int sy, int32_t *pad, int32_t *out,
+                            const int factor, const int channels, const int wide) {
+   const int (*weights)[4] = (factor == 2) ? up2_weights : up4_weights;
+   const int *offset = (factor == 2) ? up2_offset : up4_offset;
+   const size_t count = (size_t)source_image->x * channels;
+   const unsigned char *row;
+   size_t n;
+   int x, p, i;
+
+   CLAMP(sy, 0, source_image->y - 1);
+   row = image_row(source_image, sy);
+
+   for (n = 0; n < count; n++) {
+      pad[2*channels + n] = wide ? ((const uint16_t *)row)[n] : row[n];
+   }
+   for (x = 0; x < 2; x++) {
+      for (i = 0; i < channels; i++) {
+         pad[x*channels + i] = pad[2*channels + i];
+         pad[2*channels + count + x*channels + i] = pad[count + channels + i];
+      }
+   }
+   // 16 bit products keep their top 16 bits so the filtered row fits in 32,
+   // the error is under one step once composited
+   if (HAS_ALPHA(channels)) {
+      for (n = 0; n < count + 4*channels; n += channels) {
+         for (i = 0; i < channels - 1; i++) {
+            pad[n + i] = (int32_t)(((int64_t)pad[n + i] * pad[n + channels - 1]) >> (wide ? 16 : 0));
+         }
+      }
+   }
+
+   for (p = 0; p < factor; p++) {
+      const int32_t *in = pad + (offset[p] + 1) * channels;
+      const int w0 = weights[p][0], w1 = weights[p][1], w2 = weights[p][2], w3 = weights[p][3];
+      int32_t *plane = out + p * count;
+
+      for (n = 0; n < count; n++) {
+         plane[n] = w0 * in[n] + w1 * in[channels + n] + w2 * in[2*channels + n] + w3 * in[3*channels + n];
+      }
+   }
+}
+
+/*---------------------------------------------------------------------------
+   This is a quick function to resize an input image up by exactly 2 or 4.
+   With pixel centers aligned every destination pixel has one of a few
+   fixed phases, so the bicubic weights are constants and the filter runs in
+   integers, one filtered row per source row and a four row weighted sum per
+   destination row.  Like the quick 2x down sample it works on the stored
+   sample values, --linear is not applied.
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - Output image, factor times the source
+         const int factor              - 2 or 4
+         const int channels            - Samples per pixel
+         const int wide                - Set for 16 bit samples
+   returns:  nothing
    
+   error handling: none
+----------------------------------------------------------------------------*/
+static inline void resize_up_n(PPMImage *source_image, PPMImage *destination_image, const int factor,
+                               const int channels, const int wide) {
+   const int (*weights)[4] = (factor == 2) ? up2_weights : up4_weights;
+   const int *offset = (factor == 2) ? up2_offset : up4_offset;
+   const size_t count = (size_t)source_image->x * channels;
+   const int maxval = destination_image->maxval;
+   size_t pad_size = (count + 4 * channels) * sizeof(int32_t);
+   size_t ring_size = UP_RING_ROWS * factor * count * sizeof(int32_t);
+   size_t sum_size = count * sizeof(int64_t);
+   int32_t *pad = (int32_t *)pool_alloc(pad_size);
+   int32_t *ring = (int32_t *)pool_alloc(ring_size);
+   int64_t *sum = (int64_t *)pool_alloc(sum_size);
+   int held[UP_RING_ROWS];
+   int y, r, j, p;
+   size_t n, k;
+
+   // The ring holds filtered rows by source row, the sources a destination
+   // row needs are never more than UP_RING_ROWS apart
+   for (r = 0; r < UP_RING_ROWS; r++) { held[r] = INT_MIN; }
+
    for (y = 0; y < destination_image->y; y++) {
-      for (x = 0; x < destination_image->x; x++) {
-         destination_image->data[x+((destination_image->x)*y)].red = (int)(
-				source_image->data[(2*x  +((source_image->x)*2*y))].red
-				+ source_image->data[(2*x+1+((source_image->x)*2*y))].red
-				+ source_image->data[(2*x  +(((source_image->x))*(2*y+1)))].red
-				+ source_image->data[(2*x+1+(((source_image->x))*(2*y+1)))].red
-				)/4;
-         destination_image->data[x+((destination_image->x)*y)].blue = (int)(
-				source_image->data[(2*x  +((source_image->x)*2*y))].blue
-				+ source_image->data[(2*x+1+((source_image->x)*2*y))].blue
-				+ source_image->data[(2*x  +(((source_image->x))*(2*y+1)))].blue
-				+ source_image->data[(2*x+1+(((source_image->x))*(2*y+1)))].blue
-				)/4;
-         destination_image->data[x+((destination_image->x)*y)].green = (int)(
-				source_image->data[(2*x  +((source_image->x)*2*y))].green
-				+ source_image->data[(2*x+1+((source_image->x)*2*y))].green
-				+ source_image->data[(2*x  +(((source_image->x))*(2*y+1)))].green
-				+ source_image->data[(2*x+1+(((source_image->x))*(2*y+1)))].green
-				)/4;
-      } // End y
-   } // End x
+      int ky = y / factor, py = y % factor;
+      int first = ky + offset[py] - 1;
+      const int w0 = weights[py][0], w1 = weights[py][1], w2 = weights[py][2], w3 = weights[py][3];
+      const int32_t *tap[4];
+      unsigned char *out = image_row(destination_image, y);
+
+      for (j = 0; j < 4; j++) {
+         int sy = first + j;
+
+         r = (sy + UP_RING_ROWS) % UP_RING_ROWS;
+         if (held[r] != sy) {
+            up_row_n(source_image, sy, pad, ring + r * factor * count, factor, channels, wide);
+            held[r] = sy;
+         }
+         tap[j] = ring + r * factor * count;
+      }
+
+      for (p = 0; p < factor; p++) {
+         const int32_t *t0 = tap[0] + p * count, *t1 = tap[1] + p * count;
+         const int32_t *t2 = tap[2] + p * count, *t3 = tap[3] + p * count;
+
+         if (!wide && !HAS_ALPHA(channels)) {
+            // 8 bit sums fit in 32 bits, the plane is then interleaved into the row
+            uint8_t *plane = (uint8_t *)sum;
+
+            for (n = 0; n < count; n++) {
+               int32_t v = w0 * t0[n] + w1 * t1[n] + w2 * t2[n] + w3 * t3[n];
+
+               v = (v < 0) ? 0 : v >> (2 * UP_WEIGHT_BITS);
+               plane[n] = (uint8_t)((v > maxval) ? maxval : v);
+            }
+            for (k = 0; k < count; k += channels) {
+               for (j = 0; j < channels; j++) { out[k * factor + p * channels + j] = plane[k + j]; }
+            }
+            continue;
+         }
+
+         for (n = 0; n < count; n++) {
+            sum[n] = (int64_t)w0 * t0[n] + (int64_t)w1 * t1[n] + (int64_t)w2 * t2[n] + (int64_t)w3 * t3[n];
+            if (sum[n] < 0) { sum[n] = 0; }
+         }
+         for (k = 0; k < count; k += channels) {
+            int64_t *value = sum + k;
+            int i;
+
+            // Premultiplied color is divided back out by the filtered alpha,
+            // both clamped first like store_pixel_n
+            if (HAS_ALPHA(channels)) {
+               int64_t alpha = value[channels - 1];
+               int64_t limit = (((int64_t)maxval * maxval) >> (wide ? 16 : 0)) << (2 * UP_WEIGHT_BITS);
+
+               if (alpha > (int64_t)maxval << (2 * UP_WEIGHT_BITS)) {
+                  alpha = value[channels - 1] = (int64_t)maxval << (2 * UP_WEIGHT_BITS);
+               }
+               for (i = 0; i < channels - 1; i++) {
+                  if (value[i] > limit) { value[i] = limit; }
+                  value[i] = alpha ? (value[i] << (wide ? 16 : 0)) / alpha : 0;
+               }
+               value[channels - 1] >>= 2 * UP_WEIGHT_BITS;
+            }
+            else {
+               for (i = 0; i < channels; i++) { value[i] >>= 2 * UP_WEIGHT_BITS; }
+            }
+
+            for (i = 0; i < channels; i++) {
+               size_t o = k * factor + p * channels + i;
+
+               if (value[i] > maxval) { value[i] = maxval; }
+               if (wide) { ((uint16_t *)out)[o] = (uint16_t)value[i]; }
+               else      { out[o] = (uint8_t)value[i]; }
+            }
+         }
+      }
+   }
+
+   pool_free(pad, pad_size);
+   pool_free(ring, ring_size);
+   pool_free(sum, sum_size);
+}
+
+/*---------------------------------------------------------------------------
+   This is a quick function to resize an input image up by 2 or 4
+   
+         PPMImage *source_image        - Input image to resize_image
+         int factor                    - 2 or 4
+   returns:  PPMImage *destination_image  
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+PPMImage *resize_up(PPMImage *source_image, int factor) {
+   PPMImage *destination_image;
+   StageMark mark;
+   
+   stats_begin(&mark);
+   destination_image = init_destination_image(source_image, factor, OUTPUT_RGB);
+   resize_up_into(source_image, destination_image, factor);
+   stats_end(STAGE_RESAMPLE, &mark, 0, (uint64_t)destination_image->x * destination_image->y);
    
    return(destination_image);
 }
+
+/*---------------------------------------------------------------------------
+   This function runs the quick up sample into an existing image
+   
+         PPMImage *source_image        - Input image to resize_image
+         PPMImage *destination_image   - Output image, factor times the source size
+         int factor                    - 2 or 4
+   returns:  nothing
+   
+   error handling: none
+----------------------------------------------------------------------------*/
+void resize_up_into(PPMImage *source_image, PPMImage *destination_image, int factor) {
+   if (factor == 2) { DISPATCH_FORMAT(source_image, resize_up_n, source_image, destination_image, 2); }
+   else             { DISPATCH_FORMAT(source_image, resize_up_n, source_image, destination_image, 4); }
+}